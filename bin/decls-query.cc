@@ -0,0 +1,87 @@
+/*
+ * Query a database written by `decls --format=bin -o <file>`.
+ *
+ * The file is mmap'ed and read in place; name lookups go through the
+ * database's hash index, so they cost a few probes however large it is.
+ *
+ * Compile:
+ *   g++ -std=c++17 -Iinc decls-query.cc -o decls-query
+ */
+#include "declbin.hh"
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+using namespace std;
+
+static void printRecord(const declbin::Reader &db, const declbin::Record &r)
+{
+  string_view decl = db.str(r.declaration);
+  string_view file = db.str(r.file);
+  printf("%.*s  // %s at %.*s:%u:%u\n", int(decl.size()), decl.data(),
+         r.is_definition ? "definition" : "declaration", int(file.size()),
+         file.data(), r.line, r.column);
+}
+
+void printUsage(const char *prog)
+{
+  fprintf(stderr,
+          "Usage: %s <database> [options] [name...]\n"
+          "Options:\n"
+          "  -d          Show only definitions\n"
+          "  -k <kind>   Show only declarations of this kind (e.g. Function)\n"
+          "  -h, --help  Show this help\n"
+          "\nWith no names, lists every record in the database.\n",
+          prog);
+}
+
+int main(int argc, const char *argv[])
+{
+  const char *path = nullptr;
+  const char *kind = nullptr;
+  bool definitionsOnly = false;
+  vector<const char *> names;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-d") == 0) {
+      definitionsOnly = true;
+    } else if (strcmp(argv[i], "-k") == 0 && i + 1 < argc) {
+      kind = argv[++i];
+    } else if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
+      printUsage(argv[0]);
+      return 0;
+    } else if (!path) {
+      path = argv[i];
+    } else {
+      names.push_back(argv[i]);
+    }
+  }
+  if (!path) {
+    printUsage(argv[0]);
+    return 1;
+  }
+
+  declbin::Reader db;
+  string error;
+  if (!db.open(path, error)) {
+    fprintf(stderr, "Error: %s\n", error.c_str());
+    return 1;
+  }
+
+  auto show = [&](const declbin::Record &r) {
+    if (definitionsOnly && !r.is_definition)
+      return;
+    if (kind && db.str(r.kind) != kind)
+      return;
+    printRecord(db, r);
+  };
+
+  if (names.empty()) {
+    for (uint64_t i = 0; i < db.size(); i++)
+      show(db.record(i));
+  }
+  for (const char *name : names)
+    db.lookup(name, show);
+
+  return 0;
+}
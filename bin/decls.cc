@@ -13,18 +13,78 @@
  *     $(pkg-config --cflags --libs clang)
  */
 
+#include "clang-c/Index.h"
+#include "clang/AST/APValue.h"
 #include "clang/AST/ASTConsumer.h"
+#include "clang/AST/Attr.h"
+#include "clang/AST/RecordLayout.h"
 #include "clang/AST/RecursiveASTVisitor.h"
+#include "clang/Frontend/ASTUnit.h"
 #include "clang/Frontend/CompilerInstance.h"
+#include "clang/Frontend/CompilerInvocation.h"
 #include "clang/Frontend/FrontendActions.h"
+#include "clang/Frontend/Utils.h"
+#include "clang/Index/USRGeneration.h"
+#include "clang/Lex/HeaderSearch.h"
+#include "clang/Lex/PPCallbacks.h"
+#include "clang/Lex/PreprocessingRecord.h"
+#include "clang/Lex/Preprocessor.h"
+#include "clang/Tooling/ArgumentsAdjusters.h"
 #include "clang/Tooling/CommonOptionsParser.h"
 #include "clang/Tooling/Tooling.h"
 #include "clang/AST/Decl.h"
+#include "clang/AST/DeclCXX.h"
 #include "clang/AST/Type.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/Hashing.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Support/Allocator.h"
 #include "llvm/Support/CommandLine.h"
-#include <iostream>
+#include "llvm/Support/DataExtractor.h"
+#include "llvm/Support/EndianStream.h"
+#include "llvm/Support/Errno.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/FileSystem/UniqueID.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/GlobPattern.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Regex.h"
+#include "llvm/Support/Threading.h"
+#include "llvm/Support/VirtualFileSystem.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/xxhash.h"
+#include "declbin.hh"
+#include <algorithm>
+#include <atomic>
+#include <bitset>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <list>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <thread>
 #include <vector>
 #include <string>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
 
 using namespace clang;
 using namespace clang::tooling;
@@ -36,96 +96,605 @@ static cl::opt<bool> ShowMacros("m", cl::desc("Include macro definitions"),
                                  cl::cat(ToolCategory));
 static cl::opt<bool> DefinitionsOnly("d", cl::desc("Show only definitions"), 
                                       cl::cat(ToolCategory));
+static cl::opt<unsigned> Jobs("j", cl::desc("Number of worker threads (0 = one per core)"),
+                              cl::init(1), cl::cat(ToolCategory));
+static cl::opt<std::string> IndexDir("index-dir",
+    cl::desc("Keep a per-TU declaration index in <dir> and only re-parse "
+             "TUs whose inputs changed since the last run"),
+    cl::value_desc("dir"), cl::cat(ToolCategory));
+
+enum class OutputFormat { Text, Binary };
+static cl::opt<OutputFormat> Format("format", cl::desc("Output format"),
+    cl::values(clEnumValN(OutputFormat::Text, "text", "One declaration per line"),
+               clEnumValN(OutputFormat::Binary, "bin",
+                          "mmap-able database for decls-query (needs -o)")),
+    cl::init(OutputFormat::Text), cl::cat(ToolCategory));
+static cl::opt<std::string> OutputFile("o", cl::desc("Output file"),
+                                       cl::value_desc("file"), cl::cat(ToolCategory));
+static cl::opt<bool> IncludeHeaders("include-headers",
+    cl::desc("Also emit declarations from included files, each file once per run"),
+    cl::cat(ToolCategory));
+static cl::opt<bool> Fast("fast",
+    cl::desc("Signatures only: skip function bodies, warnings and typo "
+             "correction (locals are not reported)"),
+    cl::cat(ToolCategory));
+static cl::opt<bool> FoldConsts("fold-consts",
+    cl::desc("Show the folded value of const and constexpr scalar variables"),
+    cl::cat(ToolCategory));
+static cl::opt<bool> Layout("layout",
+    cl::desc("Report record layouts (size, alignment, field offsets, padding, "
+             "cache-line warnings) instead of declarations"),
+    cl::cat(ToolCategory));
+static cl::opt<unsigned> CacheLine("cache-line",
+    cl::desc("Cache line size in bytes for --layout warnings (default 64)"),
+    cl::init(64), cl::cat(ToolCategory));
+static cl::opt<std::string> PchDir("pch-dir",
+    cl::desc("Precompile #include prefixes shared between TUs into <dir> "
+             "and reuse them across TUs and runs"),
+    cl::value_desc("dir"), cl::cat(ToolCategory));
+static cl::list<std::string> KindFilter("kinds", cl::CommaSeparated,
+    cl::desc("Only these declaration kinds, as printed by clang "
+             "(e.g. Function,Var,Record,Field)"),
+    cl::value_desc("kind,..."), cl::cat(ToolCategory));
+static cl::opt<std::string> NameRegex("name",
+    cl::desc("Only declarations whose name matches <regex>"),
+    cl::value_desc("regex"), cl::cat(ToolCategory));
+static cl::opt<std::string> NameGlob("name-glob",
+    cl::desc("Only declarations whose name matches <glob>"),
+    cl::value_desc("glob"), cl::cat(ToolCategory));
+static cl::list<std::string> FileGlobs("file",
+    cl::desc("Only declarations in files matching <glob> (repeatable)"),
+    cl::value_desc("glob"), cl::cat(ToolCategory));
+static cl::opt<std::string> SymbolsFile("symbols",
+    cl::desc("Write a cross-TU symbol table, one JSON object per USR, to <file>"),
+    cl::value_desc("file"), cl::cat(ToolCategory));
+static cl::opt<std::string> TimingsFile("timings",
+    cl::desc("Per-TU parse times from the previous run, used to start the "
+             "slowest TUs first (default: <index-dir>/timings)"),
+    cl::value_desc("file"), cl::cat(ToolCategory));
+static cl::opt<std::string> ProfileFile("profile",
+    cl::desc("Write per-TU phase timings and throughput as JSON to <file>"),
+    cl::value_desc("file"), cl::cat(ToolCategory));
+enum class Backend { Libtooling, Libclang };
+static cl::opt<Backend> BackendKind("backend", cl::desc("Parser front end"),
+    cl::values(clEnumValN(Backend::Libtooling, "libtooling",
+                          "Full AST through libtooling (default)"),
+               clEnumValN(Backend::Libclang, "libclang",
+                          "libclang indexer, function bodies skipped; "
+                          "lighter, and tolerant of broken code")),
+    cl::init(Backend::Libtooling), cl::cat(ToolCategory));
+static cl::opt<std::string> ServeSocket("serve",
+    cl::desc("Run as a server on the Unix socket <path>, keeping parsed "
+             "ASTs in memory between requests"),
+    cl::value_desc("path"), cl::cat(ToolCategory));
+static cl::opt<unsigned> CacheSize("cache-size",
+    cl::desc("Number of ASTs the server keeps (default 16)"),
+    cl::init(16), cl::cat(ToolCategory));
+static cl::opt<bool> ShowStats("stats",
+    cl::desc("Print type spelling cache statistics on stderr"),
+    cl::cat(ToolCategory));
+
+// Run-wide counters for --stats; each visitor adds its own when done.
+struct DeclStats {
+    std::atomic<uint64_t> TypeHits{0};
+    std::atomic<uint64_t> TypeMisses{0};
+};
+static DeclStats Stats;
+
+#ifdef DECLS_COUNT_ALLOCS
+// Allocation counting for measuring the rendering path: build with
+// -DDECLS_COUNT_ALLOCS and decls reports on stderr how many heap
+// allocations the visitor made per declaration it rendered.
+static thread_local uint64_t ThreadAllocs = 0;
+static std::atomic<uint64_t> RenderAllocs{0};
+static std::atomic<uint64_t> RenderedDecls{0};
+
+void *operator new(size_t Size) {
+    ++ThreadAllocs;
+    if (void *P = std::malloc(Size ? Size : 1))
+        return P;
+    report_bad_alloc_error("decls: out of memory");
+}
+void operator delete(void *P) noexcept { std::free(P); }
+void operator delete(void *P, size_t) noexcept { std::free(P); }
+#endif
+
+// Arena-backed string interner. Every distinct string is copied once into
+// the StringMap's bump allocator and handed out as a small integer ID;
+// ID 0 is always the empty string. Not thread-safe: one pool per worker.
+using StrId = uint32_t;
+
+class StringPool {
+public:
+    StringPool() { intern(""); }
+
+    StrId intern(StringRef S) {
+        auto R = Map.try_emplace(S, StrId(Strings.size()));
+        if (R.second)
+            Strings.push_back(R.first->getKey());
+        return R.first->getValue();
+    }
+
+    StringRef str(StrId Id) const { return Strings[Id]; }
+    size_t size() const { return Strings.size(); }
+
+    // Frees every string; IDs handed out before are invalid afterwards.
+    void clear() { *this = StringPool(); }
+
+private:
+    StringMap<StrId, BumpPtrAllocator> Map;
+    std::vector<StringRef> Strings;
+};
 
 struct DeclInfo {
-    std::string kind;
-    std::string declaration;
+    StrId kind;
+    StrId name;
+    StrId declaration;
+    StrId file;
+    StrId usr;  // only with --symbols, and only for non-local declarations
     bool is_definition;
     unsigned line;
     unsigned column;
 };
 
+// Wire form of one DeclInfo, shared by index entries and the chunks handed
+// to the binary writer: strings inline and length-prefixed, integers
+// little-endian.
+static void writeDecl(support::endian::Writer &W, const StringPool &Pool,
+                      const DeclInfo &decl) {
+    for (StrId Id : {decl.kind, decl.name, decl.declaration, decl.file, decl.usr}) {
+        StringRef S = Pool.str(Id);
+        W.write<uint32_t>(S.size());
+        W.OS << S;
+    }
+    W.write<uint8_t>(decl.is_definition);
+    W.write<uint32_t>(decl.line);
+    W.write<uint32_t>(decl.column);
+}
+
+static DeclInfo readDecl(const DataExtractor &DE, DataExtractor::Cursor &C,
+                         StringPool &Pool) {
+    DeclInfo info;
+    info.kind = Pool.intern(DE.getBytes(C, DE.getU32(C)));
+    info.name = Pool.intern(DE.getBytes(C, DE.getU32(C)));
+    info.declaration = Pool.intern(DE.getBytes(C, DE.getU32(C)));
+    info.file = Pool.intern(DE.getBytes(C, DE.getU32(C)));
+    info.usr = Pool.intern(DE.getBytes(C, DE.getU32(C)));
+    info.is_definition = DE.getU8(C);
+    info.line = DE.getU32(C);
+    info.column = DE.getU32(C);
+    return info;
+}
+
+// Text form of one DeclInfo; the file is only shown when declarations can
+// come from more than one file.
+static void printDecl(raw_ostream &OS, const StringPool &Pool,
+                      const DeclInfo &decl, bool WithFile) {
+    OS << Pool.str(decl.declaration) << "  // "
+       << (decl.is_definition ? "definition" : "declaration") << " at ";
+    if (WithFile)
+        OS << Pool.str(decl.file) << ":";
+    OS << decl.line << ":" << decl.column << "\n";
+}
+
+// Which TU emits each file's declarations in --include-headers mode, keyed
+// by the file's UniqueID so different spellings of one path agree. A file
+// belongs to the first TU in source-path order that has declarations in
+// it, however the workers are scheduled: every TU claims its files, and
+// the sink asks for the owner only when writing a TU, once every TU before
+// it is done. The map is sharded so workers claiming different headers
+// rarely contend.
+class HeaderOwners {
+public:
+    // False once an earlier TU has claimed the file, as TU cannot own it
+    // any more; true means it might.
+    bool claim(const sys::fs::UniqueID &ID, unsigned TU) {
+        Shard &S = shard(ID);
+        std::lock_guard<std::mutex> Guard(S.Lock);
+        unsigned &Owner = S.Owner.try_emplace(ID, TU).first->second;
+        Owner = std::min(Owner, TU);
+        return Owner == TU;
+    }
+
+    // Settled once every TU before TU has claimed its files.
+    bool owns(const sys::fs::UniqueID &ID, unsigned TU) {
+        Shard &S = shard(ID);
+        std::lock_guard<std::mutex> Guard(S.Lock);
+        auto It = S.Owner.find(ID);
+        return It != S.Owner.end() && It->second == TU;
+    }
+
+private:
+    static constexpr unsigned NumShards = 64;
+    struct Shard {
+        std::mutex Lock;
+        DenseMap<sys::fs::UniqueID, unsigned> Owner;
+    };
+
+    Shard &shard(const sys::fs::UniqueID &ID) {
+        return Shards[hash_combine(ID.getDevice(), ID.getFile()) % NumShards];
+    }
+
+    Shard Shards[NumShards];
+};
+
+// Records of headers already rendered in this run, for --include-headers
+// with --index-dir. Each TU's index entry needs all of its headers, but
+// only the first TU to reach a header walks and renders it; later ones
+// copy its records (in writeDecl() form) from here. Entries are keyed by
+// file, compile directory and spelling, so a copied record reads exactly
+// as if the TU had rendered it. Once Limit bytes are held nothing more is
+// added, and TUs render the remaining headers themselves.
+class HeaderCache {
+public:
+    using Records = std::shared_ptr<const std::string>;
+
+    static std::string key(const sys::fs::UniqueID &ID, StringRef Directory,
+                           StringRef Spelling) {
+        std::string Key;
+        raw_string_ostream(Key) << ID.getDevice() << ':' << ID.getFile() << '\0'
+                                << Directory << '\0' << Spelling;
+        return Key;
+    }
+
+    Records get(StringRef Key) {
+        std::lock_guard<std::mutex> Guard(Lock);
+        auto It = Entries.find(Key);
+        return It == Entries.end() ? nullptr : It->second;
+    }
+
+    bool contains(StringRef Key) { return get(Key) != nullptr; }
+
+    void put(StringRef Key, std::string Data) {
+        std::lock_guard<std::mutex> Guard(Lock);
+        if (Size + Data.size() > Limit)
+            return;
+        size_t Bytes = Data.size();
+        if (Entries.try_emplace(Key, std::make_shared<const std::string>(std::move(Data)))
+                .second)
+            Size += Bytes;
+    }
+
+private:
+    static constexpr size_t Limit = 64 << 20;
+    std::mutex Lock;
+    StringMap<Records> Entries;
+    size_t Size = 0;
+};
+
+// Query predicates (--kinds, --name, --name-glob, --file, -d), checked
+// while the AST is walked: declarations that cannot match are never
+// rendered, and subtrees that cannot contain a match are not entered.
+class DeclFilter {
+public:
+    bool init() {
+        for (const std::string &Name : KindFilter) {
+            std::optional<Decl::Kind> K = kindByName(Name);
+            if (!K) {
+                errs() << "decls: unknown declaration kind '" << Name << "'\n";
+                return false;
+            }
+            Kinds.set(*K);
+        }
+        if (!NameRegex.empty()) {
+            Name.emplace(NameRegex);
+            std::string Error;
+            if (!Name->isValid(Error)) {
+                errs() << "decls: bad --name regex: " << Error << "\n";
+                return false;
+            }
+        }
+        if (!NameGlob.empty() && !addGlob(NameGlob, NamePatterns))
+            return false;
+        for (const std::string &Glob : FileGlobs)
+            if (!addGlob(Glob, FilePatterns))
+                return false;
+
+        // What can be declared inside each kind of parent.
+        EnumChildren = wantsRange(Decl::EnumConstant, Decl::EnumConstant);
+        CRecordChildren = wantsRange(Decl::firstField, Decl::lastField) ||
+                          wantsRange(Decl::firstTag, Decl::lastTag) ||
+                          EnumChildren;
+        // C allows block-scope function declarations too, not just C++.
+        FunctionChildren = CRecordChildren ||
+                           wantsRange(Decl::firstVar, Decl::lastVar) ||
+                           wantsRange(Decl::firstTypedefName, Decl::lastTypedefName) ||
+                           wantsRange(Decl::firstFunction, Decl::lastFunction);
+        return true;
+    }
+
+    bool wantsKind(Decl::Kind K) const { return Kinds.none() || Kinds.test(K); }
+
+    bool wantsName(StringRef S) const {
+        if (Name && !Name->match(S))
+            return false;
+        for (const GlobPattern &G : NamePatterns)
+            if (!G.match(S))
+                return false;
+        return true;
+    }
+
+    bool filtersFiles() const { return !FilePatterns.empty(); }
+
+    // Paths match as spelled or, if relative, as absolute paths.
+    bool wantsFile(StringRef Path) const {
+        if (FilePatterns.empty())
+            return true;
+        SmallString<256> Abs(Path);
+        sys::fs::make_absolute(Abs);
+        for (const GlobPattern &G : FilePatterns)
+            if (G.match(Path) || G.match(Abs))
+                return true;
+        return false;
+    }
+
+    // False when nothing declared inside D can match, e.g. the fields of a
+    // C struct when only functions are wanted.
+    bool wantsChildren(const Decl *D) const {
+        if (Kinds.none())
+            return true;
+        if (isa<EnumDecl>(D))
+            return EnumChildren;
+        if (isa<RecordDecl>(D) && !isa<CXXRecordDecl>(D))
+            return CRecordChildren;
+        if (isa<FunctionDecl>(D))
+            return FunctionChildren;
+        return true;
+    }
+
+    static std::optional<Decl::Kind> kindByName(StringRef Name) {
+#define DECL(DERIVED, BASE) if (Name == #DERIVED) return Decl::DERIVED;
+#define ABSTRACT_DECL(DECL)
+#include "clang/AST/DeclNodes.inc"
+        return std::nullopt;
+    }
+
+    // Part of the index fingerprint: entries only hold what matched.
+    void describe(raw_ostream &OS) const {
+        for (const std::string &K : KindFilter)
+            OS << " kind=" << K;
+        if (!NameRegex.empty())
+            OS << " name=" << NameRegex;
+        if (!NameGlob.empty())
+            OS << " name-glob=" << NameGlob;
+        for (const std::string &F : FileGlobs)
+            OS << " file=" << F;
+        if (DefinitionsOnly)
+            OS << " definitions-only";
+    }
+
+private:
+    static constexpr unsigned NumDeclKinds = 0
+#define DECL(DERIVED, BASE) + 1
+#define ABSTRACT_DECL(DECL)
+#include "clang/AST/DeclNodes.inc"
+        ;
+
+    static bool addGlob(StringRef Glob, std::vector<GlobPattern> &Out) {
+        Expected<GlobPattern> G = GlobPattern::create(Glob);
+        if (!G) {
+            errs() << "decls: bad glob '" << Glob << "': " << toString(G.takeError())
+                   << "\n";
+            return false;
+        }
+        Out.push_back(std::move(*G));
+        return true;
+    }
+
+    bool wantsRange(unsigned First, unsigned Last) const {
+        for (unsigned K = First; K <= Last; ++K)
+            if (Kinds.test(K))
+                return true;
+        return false;
+    }
+
+    std::bitset<NumDeclKinds> Kinds;
+    std::optional<Regex> Name;
+    std::vector<GlobPattern> NamePatterns;
+    std::vector<GlobPattern> FilePatterns;
+    bool EnumChildren = true;
+    bool CRecordChildren = true;
+    bool FunctionChildren = true;
+};
+static DeclFilter Filter;
+
+// Records of a cached header, to go in at position At of a TU's records.
+struct Splice {
+    size_t At;
+    HeaderCache::Records Records;
+};
+
+// Which files the visitor collects from: the main file only, or (with
+// Owners set) every file this TU might own. KeepAll collects every file,
+// so index entries stay complete, and leaves ownership to the emitter;
+// files already in Cache are spliced in from there instead of walked.
+struct FileScope {
+    HeaderOwners *Owners = nullptr;
+    unsigned TU = 0;
+    bool KeepAll = false;
+    HeaderCache *Cache = nullptr;
+    std::string Directory;  // compile directory, for Cache keys
+    std::vector<Splice> *Spliced = nullptr;
+    // Files with records spelled in another file's macros; these are
+    // never cached.
+    DenseSet<sys::fs::UniqueID> *Mixed = nullptr;
+
+    // Whether to collect from a file, asked when the first declaration in
+    // it is reached, with Count records collected so far.
+    bool enter(const sys::fs::UniqueID &ID, StringRef Name, size_t Count) const {
+        if (!Filter.wantsFile(Name))
+            return false;
+        if (!KeepAll)
+            return Owners->claim(ID, TU);
+        if (Cache) {
+            if (HeaderCache::Records R = Cache->get(HeaderCache::key(ID, Directory, Name))) {
+                Spliced->push_back(Splice{Count, std::move(R)});
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
 // Visitor that walks the AST and collects declarations
 class DeclVisitor : public RecursiveASTVisitor<DeclVisitor> {
 public:
     explicit DeclVisitor(ASTContext *Context, SourceManager &SM, 
-                         std::vector<DeclInfo> &Decls)
-        : Context(Context), SM(SM), Decls(Decls) {}
+                         std::vector<DeclInfo> &Decls, StringPool &Pool,
+                         FileScope Scope = FileScope())
+        : Context(Context), SM(SM), Decls(Decls), Pool(Pool), Scope(Scope) {}
+
+    ~DeclVisitor() {
+        Stats.TypeHits.fetch_add(TypeHits, std::memory_order_relaxed);
+        Stats.TypeMisses.fetch_add(TypeMisses, std::memory_order_relaxed);
+    }
 
     bool shouldVisitDecl(Decl *D) {
         if (!D->getLocation().isValid())
             return false;
         
         // Only process declarations in the main file
-        if (!SM.isInMainFile(D->getLocation()))
-            return false;
-        
-        return true;
+        if (!Scope.Owners)
+            return SM.isInMainFile(D->getLocation());
+
+        // ...or in any file this TU might own
+        FileID FID = SM.getFileID(SM.getExpansionLoc(D->getLocation()));
+        auto R = Owned.try_emplace(FID, false);
+        if (R.second) {
+            if (OptionalFileEntryRef FE = SM.getFileEntryRefForID(FID))
+                R.first->second =
+                    Scope.enter(FE->getUniqueID(), FE->getName(), Decls.size());
+        }
+        return R.first->second;
+    }
+
+    // Skip whole subtrees this TU does not emit, such as header
+    // declarations when only the main file is wanted, and the inside of
+    // declarations whose members the filter cannot match.
+    bool TraverseDecl(Decl *D) {
+        if (D && !isa<TranslationUnitDecl>(D) && D->getLocation().isValid() &&
+            !shouldVisitDecl(D))
+            return true;
+        // Layouts of function-local records are not interesting.
+        if (Layout && isa_and_nonnull<FunctionDecl>(D))
+            return true;
+        if (D && !Filter.wantsChildren(D)) {
+            // What the Visit* method would have done for D itself; these
+            // are all FunctionDecl, RecordDecl or EnumDecl.
+            addDeclaration(D);
+            return true;
+        }
+        return RecursiveASTVisitor<DeclVisitor>::TraverseDecl(D);
+    }
+
+    // Spelling of T, printed once per ASTContext and interned. The key is
+    // the sugared type's opaque pointer rather than the canonical type's:
+    // size_t and unsigned long share a canonical type but not a spelling.
+    StringRef typeSpelling(QualType T) {
+        auto R = TypeSpellings.try_emplace(T.getAsOpaquePtr());
+        if (!R.second) {
+            ++TypeHits;
+            return R.first->second;
+        }
+        ++TypeMisses;
+        TypeBuf.clear();
+        raw_svector_ostream OS(TypeBuf);
+        T.print(OS, Policy);
+        return R.first->second = Pool.str(Pool.intern(TypeBuf.str()));
     }
 
-    std::string getFunctionSignature(FunctionDecl *FD) {
-        std::string result;
-        QualType RT = FD->getReturnType();
-        result = RT.getAsString() + " " + FD->getNameAsString() + "(";
+    void printFunctionSignature(raw_ostream &OS, FunctionDecl *FD) {
+        OS << typeSpelling(FD->getReturnType()) << ' ' << FD->getDeclName() << '(';
         
         unsigned NumParams = FD->getNumParams();
         if (NumParams == 0) {
-            result += "void";
+            OS << "void";
         } else {
             for (unsigned i = 0; i < NumParams; ++i) {
-                if (i > 0) result += ", ";
+                if (i > 0) OS << ", ";
                 ParmVarDecl *Param = FD->getParamDecl(i);
-                result += Param->getType().getAsString();
-                if (!Param->getNameAsString().empty()) {
-                    result += " " + Param->getNameAsString();
-                }
+                OS << typeSpelling(Param->getType());
+                if (IdentifierInfo *II = Param->getIdentifier())
+                    OS << ' ' << II->getName();
             }
         }
-        result += ")";
-        return result;
+        OS << ')';
     }
 
-    std::string getDeclarationString(Decl *D) {
-        std::string result;
+    // Renders D into the visitor's buffer; the result is only valid until
+    // the next call. Types print with the same default policy that
+    // QualType::getAsString() uses, so the text is unchanged, but nothing
+    // here allocates once the buffer has grown to fit.
+    StringRef getDeclarationString(Decl *D) {
+        Buf.clear();
+        raw_svector_ostream OS(Buf);
         
         if (auto *FD = dyn_cast<FunctionDecl>(D)) {
-            result = getFunctionSignature(FD) + ";";
+            printFunctionSignature(OS, FD);
+            OS << ';';
         } 
         else if (auto *VD = dyn_cast<VarDecl>(D)) {
-            result = VD->getType().getAsString() + " " + VD->getNameAsString() + ";";
+            OS << typeSpelling(VD->getType()) << ' ' << VD->getDeclName();
+            if (FoldConsts)
+                printFoldedValue(OS, VD);
+            OS << ';';
         }
         else if (auto *TD = dyn_cast<TypedefDecl>(D)) {
-            QualType UnderlyingType = TD->getUnderlyingType();
-            result = "typedef " + UnderlyingType.getAsString() + " " + 
-                     TD->getNameAsString() + ";";
+            OS << "typedef " << typeSpelling(TD->getUnderlyingType()) << ' '
+               << TD->getDeclName() << ';';
         }
         else if (auto *RD = dyn_cast<RecordDecl>(D)) {
-            std::string name = RD->getNameAsString();
-            if (name.empty()) name = "<anonymous>";
-            result = std::string(RD->isStruct() ? "struct " : 
-                                RD->isUnion() ? "union " : "class ") + name + ";";
+            OS << (RD->isStruct() ? "struct " : RD->isUnion() ? "union " : "class ");
+            printName(OS, RD);
+            OS << ';';
         }
         else if (auto *ED = dyn_cast<EnumDecl>(D)) {
-            std::string name = ED->getNameAsString();
-            if (name.empty()) name = "<anonymous>";
-            result = "enum " + name + ";";
+            OS << "enum ";
+            printName(OS, ED);
+            OS << ';';
         }
         else if (auto *FD = dyn_cast<FieldDecl>(D)) {
-            result = FD->getType().getAsString() + " " + FD->getNameAsString() + ";";
+            OS << typeSpelling(FD->getType()) << ' ' << FD->getDeclName() << ';';
         }
         else if (auto *ECD = dyn_cast<EnumConstantDecl>(D)) {
-            result = ECD->getNameAsString();
-            if (ECD->getInitExpr()) {
-                // Could print the value here if we evaluate the expression
-                result += " = <value>";
-            }
+            // Sema has already folded every enumerator, implicit ones
+            // included, into an APSInt on the decl: printing it is O(1).
+            OS << ECD->getDeclName() << " = " << ECD->getInitVal();
         }
         else {
-            result = D->getDeclKindName() + std::string(": ") + 
-                     cast<NamedDecl>(D)->getNameAsString();
+            OS << D->getDeclKindName() << ": " << cast<NamedDecl>(D)->getDeclName();
         }
         
-        return result;
+        return Buf.str();
+    }
+
+    // " = <value>" for a const or constexpr integer, enum or floating
+    // variable with static storage whose initializer folds to a constant.
+    // evaluateValue() caches the result on the decl, so redeclarations
+    // and later lookups do not evaluate it again.
+    void printFoldedValue(raw_ostream &OS, VarDecl *VD) {
+        QualType T = VD->getType();
+        if (isa<ParmVarDecl>(VD) || !VD->hasGlobalStorage() ||
+            T->isDependentType() ||
+            !(VD->isConstexpr() || T.isConstQualified()) ||
+            !(T->isIntegralOrEnumerationType() || T->isRealFloatingType()))
+            return;
+        const VarDecl *Def = nullptr;
+        const Expr *Init = VD->getAnyInitializer(Def);
+        if (!Init || Init->isValueDependent())
+            return;
+        if (APValue *V = Def->evaluateValue()) {
+            OS << " = ";
+            V->printPretty(OS, *Context, T);
+        }
+    }
+
+    // Anonymous records and enums print as "<anonymous>".
+    static void printName(raw_ostream &OS, NamedDecl *ND) {
+        if (ND->getDeclName().isEmpty())
+            OS << "<anonymous>";
+        else
+            OS << ND->getDeclName();
     }
 
     bool isDefinition(Decl *D) {
@@ -142,19 +711,223 @@ public:
     }
 
     void addDeclaration(Decl *D) {
-        if (!shouldVisitDecl(D))
+        if (!Filter.wantsKind(D->getKind()) || !shouldVisitDecl(D))
+            return;
+        bool Definition = isDefinition(D);
+        if (DefinitionsOnly && !Definition)
+            return;
+
+#ifdef DECLS_COUNT_ALLOCS
+        uint64_t AllocsBefore = ThreadAllocs;
+#endif
+        StringRef Name;
+        if (auto *ND = dyn_cast<NamedDecl>(D)) {
+            if (IdentifierInfo *II = ND->getIdentifier()) {
+                Name = II->getName();
+            } else {
+                NameBuf.clear();
+                raw_svector_ostream OS(NameBuf);
+                OS << ND->getDeclName();
+                Name = NameBuf.str();
+            }
+        }
+        if (!Filter.wantsName(Name))
             return;
+        if (Layout) {
+            if (auto *RD = dyn_cast<RecordDecl>(D))
+                addLayout(RD, Name);
+            return;
+        }
 
         DeclInfo info;
-        info.kind = D->getDeclKindName();
-        info.declaration = getDeclarationString(D);
-        info.is_definition = isDefinition(D);
+        info.kind = Pool.intern(D->getDeclKindName());
+        info.name = Pool.intern(Name);
+        info.declaration = Pool.intern(getDeclarationString(D));
+        info.is_definition = Definition;
+        info.usr = 0;
+        // Parameters and locals cannot be referred to from another TU.
+        if (!SymbolsFile.empty() && !isa<ParmVarDecl>(D) &&
+            !D->getParentFunctionOrMethod()) {
+            UsrBuf.clear();
+            if (!index::generateUSRForDecl(D, UsrBuf))
+                info.usr = Pool.intern(UsrBuf.str());
+        }
         
         SourceLocation Loc = D->getLocation();
-        info.line = SM.getSpellingLineNumber(Loc);
-        info.column = SM.getSpellingColumnNumber(Loc);
+        info.file = fileOf(Loc);
+        info.line = SM.getExpansionLineNumber(Loc);
+        info.column = SM.getExpansionColumnNumber(Loc);
         
         Decls.push_back(info);
+#ifdef DECLS_COUNT_ALLOCS
+        RenderAllocs.fetch_add(ThreadAllocs - AllocsBefore, std::memory_order_relaxed);
+        RenderedDecls.fetch_add(1, std::memory_order_relaxed);
+#endif
+    }
+
+    // --layout: a RecordLayout entry for each complete record, then a
+    // FieldLayout per field with LayoutHole entries for the padding
+    // between them, and LayoutWarning entries for fields that straddle a
+    // cache line and for lines shared by annotate("hot") and
+    // annotate("cold") fields. Offsets are from the start of the record,
+    // assumed to be cache-line aligned.
+    void addLayout(RecordDecl *RD, StringRef Name) {
+        if (!RD->isCompleteDefinition() || RD->isInvalidDecl() ||
+            RD->isDependentType())
+            return;
+        auto *CXX = dyn_cast<CXXRecordDecl>(RD);
+        if (CXX && CXX->isLambda())
+            return;
+        const ASTRecordLayout &L = Context->getASTRecordLayout(RD);
+        const uint64_t CharBits = Context->getCharWidth();
+        const uint64_t Line = std::max(1u, unsigned(CacheLine));
+        uint64_t Size = L.getSize().getQuantity();
+        // Holes are only meaningful when the fields account for every
+        // byte: not in unions, and not next to bases or a vtable pointer.
+        bool Holes = !RD->isUnion() &&
+                     !(CXX && (CXX->getNumBases() || CXX->getNumVBases() ||
+                               CXX->isDynamicClass()));
+
+        struct FieldSlot {
+            FieldDecl *FD;
+            uint64_t Offset;  // bits
+            uint64_t Size;    // bits
+        };
+        SmallVector<FieldSlot, 16> Fields;
+        for (FieldDecl *FD : RD->fields()) {
+            uint64_t Bits = FD->isBitField() ? FD->getBitWidthValue(*Context)
+                            : FD->getType()->isIncompleteArrayType()
+                                ? 0
+                                : Context->getTypeSize(FD->getType());
+            Fields.push_back({FD, L.getFieldOffset(FD->getFieldIndex()), Bits});
+        }
+        uint64_t Padding = 0, End = 0;
+        if (Holes) {
+            for (const FieldSlot &F : Fields) {
+                Padding += gapBytes(End, F.Offset, CharBits);
+                End = std::max(End, F.Offset + F.Size);
+            }
+            Padding += gapBytes(End, Size * CharBits, CharBits);
+        }
+
+        SmallString<64> Record;
+        Record += RD->getKindName();
+        Record += ' ';
+        Record += Name.empty() ? StringRef("<anonymous>") : Name;
+
+        Buf.clear();
+        raw_svector_ostream OS(Buf);
+        OS << Record << ": size " << Size << ", align "
+           << L.getAlignment().getQuantity();
+        if (Holes)
+            OS << ", " << Padding << " bytes padding";
+        addLayoutEntry("RecordLayout", RD, Name, /*Definition=*/true);
+
+        SmallVector<std::pair<FieldDecl *, FieldDecl *>, 8> Heat(
+            (Size + Line - 1) / Line);
+        End = 0;
+        for (const FieldSlot &F : Fields) {
+            StringRef FieldName = F.FD->getName();
+            if (FieldName.empty())
+                FieldName = "<anonymous>";
+            if (Holes && gapBytes(End, F.Offset, CharBits)) {
+                Buf.clear();
+                OS << Record << ": " << gapBytes(End, F.Offset, CharBits)
+                   << "-byte hole at offset " << divideCeil(End, CharBits)
+                   << ", before " << FieldName;
+                addLayoutEntry("LayoutHole", F.FD, Name, false);
+            }
+            End = std::max(End, F.Offset + F.Size);
+
+            Buf.clear();
+            OS << Record << "." << FieldName << ": " << typeSpelling(F.FD->getType());
+            if (F.FD->isBitField())
+                OS << " : " << F.Size << ", bit offset " << F.Offset;
+            else
+                OS << ", offset " << F.Offset / CharBits << ", size "
+                   << F.Size / CharBits;
+            addLayoutEntry("FieldLayout", F.FD, FieldName, false);
+
+            if (!F.Size)
+                continue;
+            uint64_t First = F.Offset / CharBits / Line;
+            uint64_t Last = (F.Offset + F.Size - 1) / CharBits / Line;
+            if (First != Last && !F.FD->isBitField()) {
+                Buf.clear();
+                OS << Record << "." << FieldName << ": straddles " << Line
+                   << "-byte lines " << First << "-" << Last << " (offset "
+                   << F.Offset / CharBits << ", size " << F.Size / CharBits << ")";
+                addLayoutEntry("LayoutWarning", F.FD, FieldName, false);
+            }
+            if (int H = heat(F.FD)) {
+                for (uint64_t I = First; I <= Last && I < Heat.size(); ++I) {
+                    FieldDecl *&Slot = H > 0 ? Heat[I].first : Heat[I].second;
+                    if (!Slot)
+                        Slot = F.FD;
+                }
+            }
+        }
+        if (Holes && gapBytes(End, Size * CharBits, CharBits)) {
+            Buf.clear();
+            OS << Record << ": " << gapBytes(End, Size * CharBits, CharBits)
+               << " bytes of tail padding at offset " << divideCeil(End, CharBits);
+            addLayoutEntry("LayoutHole", RD, Name, false);
+        }
+        for (size_t I = 0; I < Heat.size(); ++I) {
+            if (!Heat[I].first || !Heat[I].second)
+                continue;
+            Buf.clear();
+            OS << Record << ": hot " << Heat[I].first->getName() << " and cold "
+               << Heat[I].second->getName() << " share " << Line << "-byte line " << I;
+            addLayoutEntry("LayoutWarning", Heat[I].first, Name, false);
+        }
+    }
+
+    // Whole bytes of padding between bit offsets From and To.
+    static uint64_t gapBytes(uint64_t From, uint64_t To, uint64_t CharBits) {
+        uint64_t Start = divideCeil(From, CharBits), Stop = To / CharBits;
+        return Stop > Start ? Stop - Start : 0;
+    }
+
+    // +1 for annotate("hot"), -1 for annotate("cold").
+    static int heat(const FieldDecl *FD) {
+        for (const auto *A : FD->specific_attrs<AnnotateAttr>()) {
+            if (A->getAnnotation() == "hot")
+                return 1;
+            if (A->getAnnotation() == "cold")
+                return -1;
+        }
+        return 0;
+    }
+
+    // Records Buf as a layout entry located at D.
+    void addLayoutEntry(const char *Kind, Decl *D, StringRef Name, bool Definition) {
+        DeclInfo info;
+        info.kind = Pool.intern(Kind);
+        info.name = Pool.intern(Name);
+        info.declaration = Pool.intern(Buf.str());
+        info.is_definition = Definition;
+        info.usr = 0;
+        SourceLocation Loc = D->getLocation();
+        info.file = fileOf(Loc);
+        info.line = SM.getExpansionLineNumber(Loc);
+        info.column = SM.getExpansionColumnNumber(Loc);
+        Decls.push_back(info);
+    }
+
+    // Records are reported in the file shouldVisitDecl walked them in, so
+    // that they are owned and printed under the same file: a name made by
+    // a macro is located where the macro is used, not in the macro's file
+    // (or in scratch space, for pasted tokens). Such a file's records
+    // depend on macros from elsewhere, so it is never cached.
+    StrId fileOf(SourceLocation Loc) {
+        SourceLocation Expansion = SM.getExpansionLoc(Loc);
+        FileID Walked = SM.getFileID(Expansion);
+        if (Scope.Mixed && Loc.isMacroID() &&
+            SM.getFileID(SM.getSpellingLoc(Loc)) != Walked)
+            if (OptionalFileEntryRef FE = SM.getFileEntryRefForID(Walked))
+                Scope.Mixed->insert(FE->getUniqueID());
+        return Pool.intern(SM.getFilename(Expansion));
     }
 
     bool VisitFunctionDecl(FunctionDecl *FD) {
@@ -196,81 +969,2297 @@ private:
     ASTContext *Context;
     SourceManager &SM;
     std::vector<DeclInfo> &Decls;
+    StringPool &Pool;
+    FileScope Scope;
+    DenseMap<FileID, bool> Owned;
+    PrintingPolicy Policy{LangOptions()};
+    SmallString<256> Buf;
+    SmallString<64> NameBuf;
+    SmallString<64> TypeBuf;
+    SmallString<128> UsrBuf;
+    DenseMap<void *, StringRef> TypeSpellings;
+    uint64_t TypeHits = 0;
+    uint64_t TypeMisses = 0;
 };
 
-// AST Consumer that creates the visitor
-class DeclConsumer : public ASTConsumer {
+// Per-file stat and content-hash cache, shared by all workers. Headers are
+// included by many TUs, so each one is stat'ed and hashed at most once per
+// run. A Hash of 0 means the file did not exist.
+struct FileStamp {
+    uint64_t Size = 0;
+    uint64_t MTime = 0;
+    uint64_t Hash = 0;
+};
+
+class FileStamps {
 public:
-    explicit DeclConsumer(ASTContext *Context, std::vector<DeclInfo> &Decls)
-        : Visitor(Context, Context->getSourceManager(), Decls) {}
+    FileStamp get(StringRef Path) {
+        FileStamp S = stat(Path);
+        if (S.Hash == 0 && S.MTime != 0)
+            S.Hash = hash(Path);
+        return S;
+    }
 
-    virtual void HandleTranslationUnit(ASTContext &Context) {
-        Visitor.TraverseDecl(Context.getTranslationUnitDecl());
+    // Size and mtime are checked first; the contents are only hashed when
+    // those moved, so touching a file without changing it stays a hit.
+    bool unchanged(StringRef Path, const FileStamp &Old) {
+        FileStamp Now = stat(Path);
+        if (Now.MTime == 0)
+            return Old.Hash == 0;
+        if (Now.Size == Old.Size && Now.MTime == Old.MTime)
+            return true;
+        return hash(Path) == Old.Hash;
     }
 
 private:
-    DeclVisitor Visitor;
+    FileStamp stat(StringRef Path) {
+        {
+            std::lock_guard<std::mutex> Guard(Lock);
+            auto It = Cache.find(Path);
+            if (It != Cache.end())
+                return It->second;
+        }
+        FileStamp S;
+        sys::fs::file_status St;
+        if (!sys::fs::status(Path, St)) {
+            S.Size = St.getSize();
+            S.MTime = St.getLastModificationTime().time_since_epoch().count();
+        }
+        std::lock_guard<std::mutex> Guard(Lock);
+        return Cache.try_emplace(Path, S).first->second;
+    }
+
+    uint64_t hash(StringRef Path) {
+        {
+            std::lock_guard<std::mutex> Guard(Lock);
+            auto It = Cache.find(Path);
+            if (It != Cache.end() && It->second.Hash)
+                return It->second.Hash;
+        }
+        uint64_t H = 0;
+        if (auto Buf = MemoryBuffer::getFile(Path, /*IsText=*/false,
+                                             /*RequiresNullTerminator=*/false))
+            H = xxh3_64bits(arrayRefFromStringRef((*Buf)->getBuffer())) | 1;
+        std::lock_guard<std::mutex> Guard(Lock);
+        Cache[Path].Hash = H;
+        return H;
+    }
+
+    std::mutex Lock;
+    StringMap<FileStamp> Cache;
 };
 
-// Frontend Action that creates the consumer
-class DeclAction : public ASTFrontendAction {
+// Options that change what the visitor extracts (as opposed to how the
+// results are printed) and so invalidate cached index entries.
+static const uint32_t IndexVersion = 6;
+
+static std::string extractionOptions() {
+    std::string S;
+    raw_string_ostream OS(S);
+    OS << "index-v" << IndexVersion;
+    if (IncludeHeaders)
+        OS << " include-headers";
+    if (Fast)
+        OS << " fast";
+    if (FoldConsts)
+        OS << " fold-consts";
+    if (Layout)
+        OS << " layout cache-line=" << CacheLine;
+    if (BackendKind == Backend::Libclang)
+        OS << " libclang";
+    if (!SymbolsFile.empty())
+        OS << " usr";
+    Filter.describe(OS);
+    return S;
+}
+
+// Hash of everything that decides what a TU extracts to: the extraction
+// options plus each compile command's directory and arguments. Directory
+// is set to the first command's working directory.
+static uint64_t hashCompileCommands(const CompilationDatabase &Compilations,
+                                    StringRef MainFile, std::string &Directory) {
+    std::string Flags = extractionOptions();
+    Directory.clear();
+    for (const CompileCommand &Cmd : Compilations.getCompileCommands(MainFile)) {
+        if (Directory.empty())
+            Directory = Cmd.Directory;
+        Flags += '\0';
+        Flags += Cmd.Directory;
+        for (const std::string &Arg : Cmd.CommandLine) {
+            Flags += '\0';
+            Flags += Arg;
+        }
+    }
+    return xxh3_64bits(arrayRefFromStringRef(Flags));
+}
+
+// Where a TU's entry lives and what it was extracted with.
+struct IndexKey {
+    std::string EntryPath;
+    std::string MainFile;
+    std::string Directory;
+    uint64_t FlagsHash = 0;
+};
+
+// Records every file the preprocessor entered, system headers included,
+// since a libc upgrade changes the declarations just as much as an edit.
+class AllDependencyCollector : public DependencyCollector {
 public:
-    explicit DeclAction(std::vector<DeclInfo> &Decls) : Decls(Decls) {}
+    bool needSystemDependencies() override { return true; }
 
-    virtual std::unique_ptr<ASTConsumer> CreateASTConsumer(
-        CompilerInstance &CI, StringRef file) {
-        return std::make_unique<DeclConsumer>(&CI.getASTContext(), Decls);
+    // For front ends that report includes themselves (--backend=libclang).
+    void add(StringRef Filename) {
+        maybeAddDependency(Filename, /*FromModule=*/false, /*IsSystem=*/false,
+                           /*IsModuleFile=*/false, /*IsMissing=*/false);
+    }
+};
+
+// Persistent declaration index: one file per TU under --index-dir holding
+// the compile flags hash, every input file's stamp (main file first, then
+// each header the preprocessor entered) and the extracted records. An entry
+// is only served when the flags match and no input has changed.
+//
+// Entry layout, little-endian:
+//   "DECLIDX\0" u32 version u64 flags-hash
+//   u32 ndeps  { u32 len, path, u64 size, u64 mtime, u64 hash }
+//   u32 nrecs  { writeDecl() }
+class DeclIndex {
+public:
+    DeclIndex(StringRef Dir, FileStamps &Stamps) : Dir(Dir.str()), Stamps(Stamps) {}
+
+    bool init() {
+        if (std::error_code EC = sys::fs::create_directories(Dir)) {
+            errs() << "decls: cannot create index directory " << Dir << ": "
+                   << EC.message() << "\n";
+            return false;
+        }
+        return true;
+    }
+
+    void makeKey(const CompilationDatabase &Compilations, StringRef Path,
+                 IndexKey &Key) {
+        SmallString<256> Abs(Path);
+        sys::fs::make_absolute(Abs);
+        sys::path::remove_dots(Abs, /*remove_dot_dot=*/true);
+        Key.MainFile = Abs.str().str();
+
+        Key.FlagsHash = hashCompileCommands(Compilations, Key.MainFile,
+                                            Key.Directory);
+
+        SmallString<256> Entry(Dir);
+        sys::path::append(Entry, utohexstr(xxh3_64bits(arrayRefFromStringRef(
+                                     Key.MainFile))) + ".idx");
+        Key.EntryPath = Entry.str().str();
+    }
+
+    bool load(const IndexKey &Key, StringPool &Pool, std::vector<DeclInfo> &Decls) {
+        auto Buf = MemoryBuffer::getFile(Key.EntryPath, /*IsText=*/false,
+                                         /*RequiresNullTerminator=*/false);
+        if (!Buf)
+            return false;
+        DataExtractor DE((*Buf)->getBuffer(), /*IsLittleEndian=*/true, 8);
+        DataExtractor::Cursor C(0);
+
+        bool Valid = DE.getBytes(C, 8) == StringRef("DECLIDX\0", 8) &&
+                     DE.getU32(C) == IndexVersion &&
+                     DE.getU64(C) == Key.FlagsHash;
+        for (uint32_t N = Valid ? DE.getU32(C) : 0; Valid && C && N; --N) {
+            StringRef Path = DE.getBytes(C, DE.getU32(C));
+            FileStamp S;
+            S.Size = DE.getU64(C);
+            S.MTime = DE.getU64(C);
+            S.Hash = DE.getU64(C);
+            Valid = C && Stamps.unchanged(Path, S);
+        }
+        for (uint32_t N = Valid ? DE.getU32(C) : 0; Valid && C && N; --N)
+            Decls.push_back(readDecl(DE, C, Pool));
+        if (Error E = C.takeError()) {
+            consumeError(std::move(E));
+            Valid = false;
+        }
+        if (!Valid)
+            Decls.clear();
+        return Valid;
+    }
+
+    void save(const IndexKey &Key, ArrayRef<std::string> Deps,
+              const StringPool &Pool, ArrayRef<DeclInfo> Decls) {
+        std::string Tmp = Key.EntryPath + ".tmp";
+        {
+            std::error_code EC;
+            raw_fd_ostream OS(Tmp, EC);
+            if (EC)
+                return;
+            support::endian::Writer W(OS, llvm::endianness::little);
+            auto writeString = [&](StringRef S) {
+                W.write<uint32_t>(S.size());
+                OS << S;
+            };
+
+            std::vector<std::string> Inputs{Key.MainFile};
+            for (const std::string &Dep : Deps) {
+                SmallString<256> Abs;
+                if (sys::path::is_relative(Dep))
+                    Abs = Key.Directory;
+                sys::path::append(Abs, Dep);
+                sys::path::remove_dots(Abs, /*remove_dot_dot=*/true);
+                if (Abs.str() != Key.MainFile)
+                    Inputs.push_back(Abs.str().str());
+            }
+
+            OS.write("DECLIDX\0", 8);
+            W.write<uint32_t>(IndexVersion);
+            W.write<uint64_t>(Key.FlagsHash);
+            W.write<uint32_t>(Inputs.size());
+            for (const std::string &Input : Inputs) {
+                FileStamp S = Stamps.get(Input);
+                writeString(Input);
+                W.write<uint64_t>(S.Size);
+                W.write<uint64_t>(S.MTime);
+                W.write<uint64_t>(S.Hash);
+            }
+            W.write<uint32_t>(Decls.size());
+            for (const DeclInfo &decl : Decls)
+                writeDecl(W, Pool, decl);
+            if (OS.has_error()) {
+                OS.clear_error();
+                sys::fs::remove(Tmp);
+                return;
+            }
+        }
+        sys::fs::rename(Tmp, Key.EntryPath);
     }
 
 private:
-    std::vector<DeclInfo> &Decls;
+    std::string Dir;
+    FileStamps &Stamps;
 };
 
-// Factory for creating our action
-class DeclActionFactory : public FrontendActionFactory {
+// The #include lines a source file starts with, before its first line of
+// anything else (comments and blank lines are skipped). This is the part
+// of a TU that can be swapped for a shared precompiled header.
+static std::vector<std::string> leadingIncludes(StringRef Path) {
+    std::vector<std::string> Lines;
+    auto Buf = MemoryBuffer::getFile(Path);
+    if (!Buf)
+        return Lines;
+    bool InComment = false;
+    StringRef Rest = (*Buf)->getBuffer();
+    while (!Rest.empty()) {
+        StringRef Line;
+        std::tie(Line, Rest) = Rest.split('\n');
+        Line = Line.trim();
+        if (InComment) {
+            size_t End = Line.find("*/");
+            if (End == StringRef::npos)
+                continue;
+            InComment = false;
+            Line = Line.substr(End + 2).trim();
+        }
+        if (Line.starts_with("/*")) {
+            size_t End = Line.find("*/", 2);
+            if (End == StringRef::npos) {
+                InComment = true;
+                continue;
+            }
+            Line = Line.substr(End + 2).trim();
+        }
+        if (Line.empty() || Line.starts_with("//"))
+            continue;
+        if (!Line.consume_front("#") || !Line.ltrim().starts_with("include"))
+            break;
+        Lines.push_back(("#" + Line.ltrim()).str());
+    }
+    return Lines;
+}
+
+// Records the file each #include line of the main file opened, by line.
+class MainFileIncludes : public PPCallbacks {
 public:
-    explicit DeclActionFactory(std::vector<DeclInfo> &Decls) : Decls(Decls) {}
+    MainFileIncludes(const SourceManager &SM,
+                     std::vector<std::pair<unsigned, FileID>> &Included)
+        : SM(SM), Included(Included) {}
 
-    std::unique_ptr<FrontendAction> create() override {
-        return std::make_unique<DeclAction>(Decls);
+    void FileChanged(SourceLocation Loc, FileChangeReason Reason,
+                     SrcMgr::CharacteristicKind, FileID) override {
+        if (Reason != EnterFile)
+            return;
+        FileID FID = SM.getFileID(Loc);
+        SourceLocation IncludeLoc = SM.getIncludeLoc(FID);
+        if (IncludeLoc.isValid() && SM.getFileID(IncludeLoc) == SM.getMainFileID())
+            Included.emplace_back(SM.getSpellingLineNumber(IncludeLoc), FID);
     }
 
 private:
-    std::vector<DeclInfo> &Decls;
+    const SourceManager &SM;
+    std::vector<std::pair<unsigned, FileID>> &Included;
 };
 
-int main(int argc, const char **argv) {
-    auto ExpectedParser = CommonOptionsParser::create(argc, argv, ToolCategory);
-    if (!ExpectedParser) {
-        llvm::errs() << ExpectedParser.takeError();
-        return 1;
+// GeneratePCHAction that also records which files went into the PCH, so a
+// cached one can be checked for staleness and TUs using it can list them
+// as their own index dependencies. Guarded[I] is set when the header
+// included on line FirstLine + I has an include guard or #pragma once.
+class PchAction : public GeneratePCHAction {
+public:
+    PchAction(std::shared_ptr<DependencyCollector> Deps, unsigned FirstLine,
+              std::vector<bool> &Guarded)
+        : Deps(std::move(Deps)), FirstLine(FirstLine), Guarded(Guarded) {}
+
+protected:
+    std::unique_ptr<ASTConsumer> CreateASTConsumer(CompilerInstance &CI,
+                                                   StringRef InFile) override {
+        Deps->attachToPreprocessor(CI.getPreprocessor());
+        CI.getPreprocessor().addPPCallbacks(
+            std::make_unique<MainFileIncludes>(CI.getSourceManager(), Included));
+        return GeneratePCHAction::CreateASTConsumer(CI, InFile);
     }
-    CommonOptionsParser &OptionsParser = ExpectedParser.get();
-    
-    ClangTool Tool(OptionsParser.getCompilations(),
-                   OptionsParser.getSourcePathList());
 
-    std::vector<DeclInfo> Decls;
-    DeclActionFactory Factory(Decls);
-    
-    int Result = Tool.run(&Factory);
-    
-    // Print results
-    if (OptionsParser.getSourcePathList().size() > 0) {
-        std::cout << "=== Declarations from " 
-                  << OptionsParser.getSourcePathList()[0] << " ===\n\n";
+    // Guards are only known once each header has been lexed to its end.
+    void EndSourceFileAction() override {
+        CompilerInstance &CI = getCompilerInstance();
+        HeaderSearch &HS = CI.getPreprocessor().getHeaderSearchInfo();
+        for (auto [Line, FID] : Included) {
+            if (Line < FirstLine || Line - FirstLine >= Guarded.size())
+                continue;
+            auto FE = CI.getSourceManager().getFileEntryRefForID(FID);
+            Guarded[Line - FirstLine] = FE && HS.isFileMultipleIncludeGuarded(*FE);
+        }
+        GeneratePCHAction::EndSourceFileAction();
     }
-    
-    for (const auto &decl : Decls) {
-        if (DefinitionsOnly && !decl.is_definition)
-            continue;
-        
-        std::cout << decl.declaration << "  // "
-                  << (decl.is_definition ? "definition" : "declaration")
-                  << " at " << decl.line << ":" << decl.column << "\n";
+
+private:
+    std::shared_ptr<DependencyCollector> Deps;
+    unsigned FirstLine;
+    std::vector<bool> &Guarded;
+    std::vector<std::pair<unsigned, FileID>> Included;
+};
+
+// One shared header prefix: a synthesized header holding the common
+// #include lines, the PCH built from it, and that PCH's inputs.
+struct PchGroup {
+    std::string Directory;
+    std::vector<std::string> Args;
+    std::vector<std::string> Lines;
+    std::string Header;
+    std::string Pch;
+    std::vector<std::string> Deps;
+    bool Ready = false;
+};
+
+// Finds header prefixes shared between TUs and builds (or reuses) one PCH
+// per prefix under --pch-dir. TUs are only grouped when they have the
+// same compile flags, directory and language, and each TU joins the
+// longest leading run of #include lines it shares with at least one other
+// TU. The TU keeps its own #include lines; with the PCH force-included
+// first, guarded headers are skipped on re-inclusion, so only the main
+// file is parsed from source. The prefix is cut before the first header
+// without an include guard or #pragma once, which would otherwise be
+// parsed a second time.
+class PchPlanner {
+public:
+    PchPlanner(StringRef Dir, FileStamps &Stamps) : Dir(Dir.str()), Stamps(Stamps) {}
+
+    bool init() {
+        if (std::error_code EC = sys::fs::create_directories(Dir)) {
+            errs() << "decls: cannot create PCH directory " << Dir << ": "
+                   << EC.message() << "\n";
+            return false;
+        }
+        return true;
+    }
+
+    void plan(const CompilationDatabase &Compilations,
+              const std::vector<std::string> &Paths) {
+        struct Candidate {
+            std::vector<std::string> Args;
+            std::string Directory;
+            std::vector<std::string> Lines;
+            std::vector<uint64_t> Prefixes;
+        };
+        std::vector<Candidate> Candidates(Paths.size());
+        DenseMap<uint64_t, unsigned> Counts;
+
+        for (size_t TU = 0; TU < Paths.size(); ++TU) {
+            SmallString<256> Abs(Paths[TU]);
+            sys::fs::make_absolute(Abs);
+            std::vector<CompileCommand> Cmds = Compilations.getCompileCommands(Abs);
+            if (Cmds.empty())
+                continue;
+            Candidate &C = Candidates[TU];
+            C.Directory = Cmds[0].Directory;
+            C.Args = baseArgs(Cmds[0]);
+            C.Args.push_back("-iquote");
+            C.Args.push_back(sys::path::parent_path(Abs).str());
+            C.Args.push_back("-x");
+            C.Args.push_back(StringRef(Abs).ends_with(".c") ? "c-header" : "c++-header");
+            C.Lines = leadingIncludes(Abs);
+
+            std::string Flags = C.Directory;
+            for (const std::string &Arg : C.Args) {
+                Flags += '\0';
+                Flags += Arg;
+            }
+            uint64_t H = xxh3_64bits(arrayRefFromStringRef(Flags));
+            for (const std::string &Line : C.Lines) {
+                H = hash_combine(H, xxh3_64bits(arrayRefFromStringRef(Line)));
+                C.Prefixes.push_back(H);
+                ++Counts[H];
+            }
+        }
+
+        TUGroup.assign(Paths.size(), -1);
+        DenseMap<uint64_t, unsigned> GroupOf;
+        for (size_t TU = 0; TU < Paths.size(); ++TU) {
+            Candidate &C = Candidates[TU];
+            size_t Len = C.Prefixes.size();
+            while (Len && Counts[C.Prefixes[Len - 1]] < 2)
+                --Len;
+            if (!Len)
+                continue;
+            uint64_t Key = C.Prefixes[Len - 1];
+            auto R = GroupOf.try_emplace(Key, Groups.size());
+            if (R.second) {
+                PchGroup G;
+                SmallString<256> Base(Dir);
+                sys::path::append(Base, utohexstr(Key));
+                G.Header = (Base.str() + ".h").str();
+                G.Pch = (Base.str() + ".pch").str();
+                G.Directory = C.Directory;
+                G.Args = std::move(C.Args);
+                G.Args.push_back(G.Header);
+                G.Args.push_back("-o");
+                G.Args.push_back(G.Pch);
+                G.Lines.assign(C.Lines.begin(), C.Lines.begin() + Len);
+                Groups.push_back(std::move(G));
+            }
+            TUGroup[TU] = R.first->second;
+        }
+    }
+
+    size_t size() const { return Groups.size(); }
+
+    // Reuses the group's PCH when none of its inputs changed since it was
+    // built, otherwise (re)builds it, a second time if the prefix has to be
+    // cut at an unguarded header. Safe to call for different groups from
+    // different threads.
+    void build(unsigned Group) {
+        PchGroup &G = Groups[Group];
+        if (!loadDeps(G)) {
+            std::vector<bool> Guarded;
+            if (!precompile(G, Guarded))
+                return;
+            size_t Len = std::find(Guarded.begin(), Guarded.end(), false) - Guarded.begin();
+            if (Len < G.Lines.size()) {
+                G.Lines.resize(Len);
+                if (Len && !precompile(G, Guarded))
+                    return;
+            }
+            saveDeps(G);
+        }
+        G.Ready = !G.Lines.empty();
+    }
+
+    const PchGroup *groupFor(unsigned TU) const {
+        if (TUGroup.empty() || TUGroup[TU] < 0 || !Groups[TUGroup[TU]].Ready)
+            return nullptr;
+        return &Groups[TUGroup[TU]];
+    }
+
+private:
+    // Builds G.Pch from G.Lines and collects its inputs into G.Deps.
+    bool precompile(PchGroup &G, std::vector<bool> &Guarded) {
+        writeHeader(G.Header, G.Lines);
+        Guarded.assign(G.Lines.size(), false);
+        auto Deps = std::make_shared<AllDependencyCollector>();
+        IntrusiveRefCntPtr<vfs::FileSystem> FS = vfs::createPhysicalFileSystem();
+        FS->setCurrentWorkingDirectory(G.Directory);
+        IntrusiveRefCntPtr<FileManager> Files(new FileManager(FileSystemOptions(), FS));
+        ToolInvocation Invocation(G.Args,
+                                  std::make_unique<PchAction>(Deps, HeaderFirstLine, Guarded),
+                                  Files.get());
+        if (!Invocation.run()) {
+            errs() << "decls: could not precompile " << G.Header
+                   << ", its TUs will be parsed in full\n";
+            return false;
+        }
+        G.Deps.clear();
+        for (const std::string &Dep : Deps->getDependencies()) {
+            SmallString<256> Abs;
+            if (sys::path::is_relative(Dep))
+                Abs = G.Directory;
+            sys::path::append(Abs, Dep);
+            sys::path::remove_dots(Abs, /*remove_dot_dot=*/true);
+            G.Deps.push_back(Abs.str().str());
+        }
+        return true;
+    }
+
+    // The TU's driver command line without its input, output and -c, plus
+    // the resource directory ClangTool would inject.
+    static std::vector<std::string> baseArgs(const CompileCommand &Cmd) {
+        std::vector<std::string> Args = getClangStripDependencyFileAdjuster()(
+            getClangStripOutputAdjuster()(Cmd.CommandLine, Cmd.Filename),
+            Cmd.Filename);
+        Args.erase(std::remove_if(Args.begin() + 1, Args.end(),
+                                  [&](const std::string &Arg) {
+                                      return Arg == "-c" || Arg == Cmd.Filename;
+                                  }),
+                   Args.end());
+        static int StaticSymbol;
+        Args.insert(Args.begin() + 1,
+                    "-resource-dir=" + CompilerInvocation::GetResourcesPath(
+                                           "clang_tool", &StaticSymbol));
+        return Args;
+    }
+
+    // The first #include is on this line of the synthesized header.
+    static constexpr unsigned HeaderFirstLine = 2;
+
+    // Left alone when it already holds Lines: clang rejects a PCH whose
+    // header is newer than the PCH itself, so rewriting it on every run
+    // would make every cached PCH unusable.
+    static void writeHeader(StringRef Path, ArrayRef<std::string> Lines) {
+        std::string Text = "// Shared header prefix synthesized by decls --pch-dir\n";
+        for (const std::string &Line : Lines)
+            Text += Line + "\n";
+        if (auto Old = MemoryBuffer::getFile(Path))
+            if ((*Old)->getBuffer() == Text)
+                return;
+
+        std::string Tmp = (Path + ".tmp").str();
+        {
+            std::error_code EC;
+            raw_fd_ostream OS(Tmp, EC);
+            if (EC)
+                return;
+            OS << Text;
+            if (OS.has_error()) {
+                OS.clear_error();
+                sys::fs::remove(Tmp);
+                return;
+            }
+        }
+        sys::fs::rename(Tmp, Path);
+    }
+
+    // <pch>.deps: "lines N" (how much of the prefix the PCH holds), then
+    // one "size mtime hash path" line per input of the PCH.
+    bool loadDeps(PchGroup &G) {
+        if (!sys::fs::exists(G.Pch))
+            return false;
+        auto Buf = MemoryBuffer::getFile(G.Pch + ".deps");
+        if (!Buf)
+            return false;
+        G.Deps.clear();
+        SmallVector<StringRef, 0> Lines;
+        (*Buf)->getBuffer().split(Lines, '\n', -1, /*KeepEmpty=*/false);
+        size_t Used;
+        if (Lines.empty() || !Lines[0].consume_front("lines ") ||
+            Lines[0].getAsInteger(10, Used) || Used > G.Lines.size())
+            return false;
+        for (StringRef Line : ArrayRef(Lines).drop_front()) {
+            SmallVector<StringRef, 4> F;
+            Line.split(F, ' ', 3);
+            FileStamp S;
+            if (F.size() != 4 || F[0].getAsInteger(10, S.Size) ||
+                F[1].getAsInteger(10, S.MTime) || F[2].getAsInteger(10, S.Hash) ||
+                !Stamps.unchanged(F[3], S))
+                return false;
+            G.Deps.push_back(F[3].str());
+        }
+        if (G.Deps.empty())
+            return false;
+        G.Lines.resize(Used);
+        return true;
+    }
+
+    void saveDeps(const PchGroup &G) {
+        std::error_code EC;
+        raw_fd_ostream OS(G.Pch + ".deps", EC);
+        if (EC)
+            return;
+        OS << "lines " << G.Lines.size() << "\n";
+        for (const std::string &Dep : G.Deps) {
+            FileStamp S = Stamps.get(Dep);
+            OS << S.Size << ' ' << S.MTime << ' ' << S.Hash << ' ' << Dep << "\n";
+        }
+    }
+
+    std::string Dir;
+    FileStamps &Stamps;
+    std::vector<PchGroup> Groups;
+    std::vector<int> TUGroup;
+};
+
+// Final destination of the per-TU chunks, which the emitters render in the
+// writer's own format. Called by one thread at a time, in TU order.
+class DeclWriter {
+public:
+    virtual ~DeclWriter() = default;
+    virtual void begin(ArrayRef<std::string> Paths) {}
+    virtual void write(StringRef Chunk) = 0;
+    virtual bool finish(size_t Total) = 0;
+};
+
+class TextWriter : public DeclWriter {
+public:
+    explicit TextWriter(raw_ostream &OS) : OS(OS) {}
+
+    void begin(ArrayRef<std::string> Paths) override {
+        if (!Paths.empty())
+            OS << "=== Declarations from " << Paths[0] << " ===\n\n";
+    }
+
+    void write(StringRef Chunk) override { OS << Chunk; }
+
+    bool finish(size_t Total) override {
+        OS << "\n=== Total: " << Total << " items ===\n";
+        OS.flush();
+        return !OS.has_error();
+    }
+
+private:
+    raw_ostream &OS;
+};
+
+// Writes the declbin.hh layout. Records are streamed straight to the file
+// as chunks arrive; only the string table (one copy of each distinct
+// string) and one name ID per record stay in memory until finish()
+// appends the table and name index and patches the header.
+class BinaryWriter : public DeclWriter {
+public:
+    explicit BinaryWriter(raw_fd_ostream &OS)
+        : OS(OS), W(OS, llvm::endianness::little) {}
+
+    void begin(ArrayRef<std::string>) override {
+        OS.write_zeros(sizeof(declbin::Header));
+    }
+
+    void write(StringRef Chunk) override {
+        DataExtractor DE(Chunk, /*IsLittleEndian=*/true, 8);
+        DataExtractor::Cursor C(0);
+        while (C && C.tell() < Chunk.size()) {
+            DeclInfo decl = readDecl(DE, C, Pool);
+            W.write<uint32_t>(offset(decl.kind));
+            W.write<uint32_t>(offset(decl.name));
+            W.write<uint32_t>(offset(decl.declaration));
+            W.write<uint32_t>(offset(decl.file));
+            W.write<uint32_t>(decl.line);
+            W.write<uint32_t>(decl.column);
+            W.write<uint8_t>(decl.is_definition);
+            OS.write_zeros(3);
+            Names.push_back(decl.name);
+        }
+        consumeError(C.takeError());
+    }
+
+    bool finish(size_t) override {
+        // The header is left zeroed, so readers reject the file.
+        if (Overflow || Names.size() >= UINT32_MAX) {
+            errs() << "decls: too much output for --format=bin (the string table "
+                      "and record count are limited to 4 GiB)\n";
+            return false;
+        }
+        declbin::Header H = {};
+        memcpy(H.magic, declbin::Magic, sizeof(H.magic));
+        H.version = declbin::Version;
+        H.record_size = sizeof(declbin::Record);
+        H.num_records = Names.size();
+        H.records_offset = sizeof(declbin::Header);
+
+        H.strtab_offset = H.records_offset + Names.size() * sizeof(declbin::Record);
+        for (size_t Id = 0; Id < Offsets.size(); ++Id)
+            OS << Pool.str(Id) << '\0';
+        H.strtab_size = StrtabSize;
+        OS.write_zeros(alignTo(StrtabSize, 4) - StrtabSize);
+
+        if (!Names.empty()) {
+            H.hash_offset = alignTo(H.strtab_offset + StrtabSize, 4);
+            H.hash_buckets = PowerOf2Ceil(Names.size() * 2);
+            std::vector<uint32_t> Slots(H.hash_buckets);
+            uint64_t Mask = H.hash_buckets - 1;
+            for (size_t I = 0; I < Names.size(); ++I) {
+                StringRef Name = Pool.str(Names[I]);
+                uint64_t B = declbin::hashName({Name.data(), Name.size()}) & Mask;
+                while (Slots[B])
+                    B = (B + 1) & Mask;
+                Slots[B] = I + 1;
+            }
+            for (uint32_t Slot : Slots)
+                W.write<uint32_t>(Slot);
+        }
+
+        OS.seek(0);
+        OS.write(H.magic, sizeof(H.magic));
+        for (uint32_t V : {H.version, H.record_size})
+            W.write<uint32_t>(V);
+        for (uint64_t V : {H.num_records, H.records_offset, H.strtab_offset,
+                           H.strtab_size, H.hash_offset, H.hash_buckets})
+            W.write<uint64_t>(V);
+        OS.flush();
+        return !OS.has_error();
+    }
+
+private:
+    // String table offset of a pool ID; new IDs are appended in order.
+    // Offsets are 32-bit in the format: past that, Overflow is set and
+    // finish() fails instead of writing a corrupt file.
+    uint32_t offset(StrId Id) {
+        while (Offsets.size() <= Id) {
+            if (StrtabSize > UINT32_MAX)
+                Overflow = true;
+            Offsets.push_back(uint32_t(StrtabSize));
+            StrtabSize += Pool.str(Offsets.size() - 1).size() + 1;
+        }
+        return Offsets[Id];
+    }
+
+    raw_fd_ostream &OS;
+    support::endian::Writer W;
+    StringPool Pool;
+    std::vector<uint32_t> Offsets;
+    uint64_t StrtabSize = 0;
+    bool Overflow = false;
+    std::vector<StrId> Names;
+};
+
+// One TU's rendered declarations. With --include-headers the text is
+// split into one section per file, in order, so that the sink can leave
+// out the files another TU owns.
+struct TUChunk {
+    struct Section {
+        sys::fs::UniqueID File;
+        size_t End;    // offset in Text just past the section
+        size_t Count;  // declarations in the section
+    };
+    std::string Text;
+    std::vector<Section> Sections;
+    size_t Count = 0;  // declarations in Text, when there are no sections
+};
+
+// Hands each TU's chunk to the writer as soon as it is ready, in
+// source-path order. Chunks that finish early wait in Pending until every
+// TU before them has been written. File ownership is settled by then, so
+// this is where sections of files owned by an earlier TU are dropped.
+// Written, if set, is told how many TUs have been written each time that
+// advances, under the sink's lock.
+class OrderedSink {
+public:
+    explicit OrderedSink(DeclWriter &Out, HeaderOwners *Owners = nullptr)
+        : Out(Out), Owners(Owners) {}
+
+    std::function<void(unsigned)> Written;
+
+    void submit(unsigned TU, TUChunk Chunk) {
+        std::lock_guard<std::mutex> Guard(Lock);
+        if (TU != NextTU) {
+            Pending.emplace(TU, std::move(Chunk));
+            return;
+        }
+        write(Chunk);
+        for (++NextTU; !Pending.empty() && Pending.begin()->first == NextTU;
+             ++NextTU) {
+            write(Pending.begin()->second);
+            Pending.erase(Pending.begin());
+        }
+        if (Written)
+            Written(NextTU);
+    }
+
+    size_t total() const { return Total; }
+
+private:
+    void write(const TUChunk &Chunk) {
+        if (Chunk.Sections.empty()) {
+            Out.write(Chunk.Text);
+            Total += Chunk.Count;
+            return;
+        }
+        size_t Begin = 0;
+        for (const TUChunk::Section &S : Chunk.Sections) {
+            if (Owners->owns(S.File, NextTU)) {
+                Out.write(StringRef(Chunk.Text).slice(Begin, S.End));
+                Total += S.Count;
+            }
+            Begin = S.End;
+        }
+    }
+
+    std::mutex Lock;
+    DeclWriter &Out;
+    HeaderOwners *Owners;
+    unsigned NextTU = 0;
+    std::map<unsigned, TUChunk> Pending;
+    size_t Total = 0;
+};
+
+// Cross-TU symbol table for --symbols: every emitted declaration that has
+// a USR is merged into one entry per USR, from all workers at once. The
+// map is sharded by USR hash so workers rarely wait on each other.
+class SymbolTable {
+public:
+    void add(unsigned TU, const StringPool &Pool, const DeclInfo &decl) {
+        StringRef Usr = Pool.str(decl.usr);
+        Shard &S = Shards[xxh3_64bits(arrayRefFromStringRef(Usr)) % NumShards];
+        std::string Site;
+        raw_string_ostream(Site) << Pool.str(decl.file) << ":" << decl.line
+                                 << ":" << decl.column;
+
+        std::lock_guard<std::mutex> Guard(S.Lock);
+        auto R = S.Symbols.try_emplace(Usr);
+        Symbol &Sym = R.first->second;
+        // The representative declaration is a definition if there is one,
+        // then the one from the earliest TU, so output is deterministic.
+        if (R.second || (decl.is_definition && !Sym.HasDefinition) ||
+            (decl.is_definition == Sym.HasDefinition && TU < Sym.TU)) {
+            Sym.TU = TU;
+            Sym.HasDefinition = decl.is_definition;
+            Sym.Kind = Pool.str(decl.kind).str();
+            Sym.Name = Pool.str(decl.name).str();
+            Sym.Declaration = Pool.str(decl.declaration).str();
+        }
+        (decl.is_definition ? Sym.Definitions : Sym.Declarations)
+            .push_back(std::move(Site));
+    }
+
+    // One JSON object per line, sorted by USR. Sites are de-duplicated: a
+    // header declaration can be added by every TU that might own the
+    // header, so each distinct site counts as one declaration.
+    bool write(StringRef File) {
+        std::error_code EC;
+        raw_fd_ostream OS(File, EC);
+        if (EC) {
+            errs() << "decls: cannot open " << File << ": " << EC.message() << "\n";
+            return false;
+        }
+        std::vector<std::pair<StringRef, Symbol *>> All;
+        for (Shard &S : Shards)
+            for (auto &E : S.Symbols)
+                All.emplace_back(E.getKey(), &E.getValue());
+        llvm::sort(All, [](const auto &A, const auto &B) { return A.first < B.first; });
+
+        auto unique = [](std::vector<std::string> &Sites) {
+            llvm::sort(Sites);
+            Sites.erase(std::unique(Sites.begin(), Sites.end()), Sites.end());
+        };
+        auto sites = [](json::OStream &J, const std::vector<std::string> &Sites) {
+            for (const std::string &Site : Sites)
+                J.value(Site);
+        };
+        for (auto &E : All) {
+            StringRef Usr = E.first;
+            Symbol *Sym = E.second;
+            unique(Sym->Definitions);
+            unique(Sym->Declarations);
+            json::OStream J(OS);
+            J.object([&] {
+                J.attribute("usr", Usr);
+                J.attribute("name", Sym->Name);
+                J.attribute("kind", Sym->Kind);
+                J.attribute("declaration", Sym->Declaration);
+                J.attribute("decls", int64_t(Sym->Definitions.size() +
+                                             Sym->Declarations.size()));
+                J.attributeArray("defined", [&] { sites(J, Sym->Definitions); });
+                J.attributeArray("declared", [&] { sites(J, Sym->Declarations); });
+            });
+            OS << "\n";
+        }
+        OS.flush();
+        return !OS.has_error();
+    }
+
+private:
+    struct Symbol {
+        std::string Kind, Name, Declaration;
+        unsigned TU = 0;
+        bool HasDefinition = false;
+        std::vector<std::string> Definitions, Declarations;
+    };
+    static constexpr unsigned NumShards = 64;
+    struct Shard {
+        std::mutex Lock;
+        StringMap<Symbol> Symbols;
+    };
+    Shard Shards[NumShards];
+};
+
+// Where one TU's time went, for --profile. Preprocessing is not split out
+// from parsing: clang lexes on demand as the parser asks for tokens, so the
+// two are interleaved and only their sum is measured.
+using ProfileClock = std::chrono::steady_clock;
+
+struct TUProfile {
+    double SetupMs = 0;   // driver, CompilerInstance, file system
+    double ParseMs = 0;   // preprocessing, parsing and Sema
+    double VisitMs = 0;   // DeclVisitor traversal
+    double OutputMs = 0;  // rendering, index entry
+    size_t Decls = 0;
+    bool Cached = false;  // served from the index
+};
+
+// Per-worker staging area: the visitor fills Decls for the TU in flight and
+// flush() renders them into one chunk for the sink. The vector is reused
+// from TU to TU and the string pool is emptied at the start of each one,
+// so memory stays bounded by the largest single TU rather than growing
+// with the run.
+class DeclEmitter {
+public:
+    DeclEmitter(OrderedSink &Sink, DeclIndex *Index, HeaderOwners *Owners,
+                std::vector<TUProfile> *Profile = nullptr,
+                SymbolTable *Symbols = nullptr, HeaderCache *Cache = nullptr)
+        : Sink(Sink), Index(Index), Owners(Owners), Profile(Profile),
+          Symbols(Symbols), Cache(Cache) {}
+
+    std::vector<DeclInfo> &decls() { return Decls; }
+    StringPool &pool() { return Pool; }
+
+    FileScope scope() {
+        FileScope S;
+        S.Owners = Owners;
+        S.TU = Current;
+        S.KeepAll = Index != nullptr;
+        if (Owners && Index && Cache) {
+            S.Cache = Cache;
+            S.Directory = Directory;
+            S.Spliced = &Spliced;
+            S.Mixed = &Mixed;
+        }
+        return S;
+    }
+
+    // Returns true when the TU was served from the index and needs no parse.
+    bool begin(unsigned TU, StringRef Path, const CompilationDatabase &Compilations,
+               ArrayRef<std::string> PchDeps = {}) {
+        Current = TU;
+        Open = true;
+        Started = ProfileClock::now();
+        Parsing = Visiting = ProfileClock::time_point();
+        Cached = false;
+        Failed = false;
+        Decls.clear();
+        Pool.clear();
+        Deps.reset();
+        ExtraDeps = PchDeps;
+        FileIDs.clear();
+        Spliced.clear();
+        Mixed.clear();
+        if (!Index) {
+            if (Owners)
+                Directory = compileDirectory(Compilations, Path);
+            return false;
+        }
+        Index->makeKey(Compilations, Path, Key);
+        Directory = Key.Directory;
+        if (!Index->load(Key, Pool, Decls))
+            return false;
+        Cached = true;
+        flush();
+        return true;
+    }
+
+    bool indexing() const { return Index != nullptr; }
+
+    // Phase boundaries for --profile: the AST consumer has been created,
+    // and the parsed AST has been handed to it.
+    void startParse() { Parsing = ProfileClock::now(); }
+    void startVisit() { Visiting = ProfileClock::now(); }
+
+    void setDependencies(std::shared_ptr<DependencyCollector> D) {
+        Deps = std::move(D);
+    }
+
+    // The TU had errors: its declarations are still emitted, but it gets
+    // no index entry, so the next run parses it (and reports them) again.
+    void fail() { Failed = true; }
+
+    void flush() {
+        if (!Open)
+            return;
+        ProfileClock::time_point Flushing = ProfileClock::now();
+        DenseSet<StrId> FromCache = splice();
+        if (Index && Deps && !Failed) {
+            // Headers that came out of a PCH were never entered by this
+            // TU's preprocessor; they are still inputs.
+            std::vector<std::string> Inputs = Deps->getDependencies();
+            Inputs.insert(Inputs.end(), ExtraDeps.begin(), ExtraDeps.end());
+            Index->save(Key, Inputs, Pool, Decls);
+        }
+        Deps.reset();
+        TUChunk Chunk;
+        raw_string_ostream OS(Chunk.Text);
+        support::endian::Writer W(OS, llvm::endianness::little);
+        if (Owners) {
+            renderSections(OS, W, Chunk, FromCache);
+        } else {
+            for (const DeclInfo &decl : Decls)
+                render(OS, W, decl);
+            Chunk.Count = Decls.size();
+        }
+        OS.flush();
+        if (Profile)
+            record(Flushing);
+        Sink.submit(Current, std::move(Chunk));
+        Decls.clear();
+        Open = false;
+    }
+
+private:
+    static std::string compileDirectory(const CompilationDatabase &Compilations,
+                                        StringRef Path) {
+        SmallString<256> Abs(Path);
+        sys::fs::make_absolute(Abs);
+        std::vector<CompileCommand> Cmds = Compilations.getCompileCommands(Abs);
+        return Cmds.empty() ? std::string() : Cmds.front().Directory;
+    }
+
+    void render(raw_ostream &OS, support::endian::Writer &W, const DeclInfo &decl) {
+        if (Symbols && decl.usr)
+            Symbols->add(Current, Pool, decl);
+        if (Format == OutputFormat::Binary)
+            writeDecl(W, Pool, decl);
+        else
+            printDecl(OS, Pool, decl, Owners != nullptr);
+    }
+
+    // Moves the records of headers copied from the cache to where the
+    // visitor would have collected them. Returns the files they are in.
+    DenseSet<StrId> splice() {
+        DenseSet<StrId> Files;
+        if (Spliced.empty())
+            return Files;
+        std::vector<DeclInfo> All;
+        size_t Next = 0;
+        for (const Splice &S : Spliced) {
+            All.insert(All.end(), Decls.begin() + Next, Decls.begin() + S.At);
+            Next = S.At;
+            DataExtractor DE(*S.Records, /*IsLittleEndian=*/true, 8);
+            DataExtractor::Cursor C(0);
+            while (C && C.tell() < S.Records->size()) {
+                All.push_back(readDecl(DE, C, Pool));
+                Files.insert(All.back().file);
+            }
+            consumeError(C.takeError());
+        }
+        All.insert(All.end(), Decls.begin() + Next, Decls.end());
+        Decls.swap(All);
+        Spliced.clear();
+        return Files;
+    }
+
+    // One section per file, sorted by file name so that the order does not
+    // depend on which headers came from the cache. Files an earlier TU has
+    // claimed already are left out; the sink drops any that an earlier TU
+    // claims after this. Files this TU walked itself are offered to the
+    // cache.
+    void renderSections(raw_string_ostream &OS, support::endian::Writer &W,
+                        TUChunk &Chunk, const DenseSet<StrId> &FromCache) {
+        std::vector<unsigned> ByFile(Decls.size());
+        for (unsigned I = 0; I < ByFile.size(); ++I)
+            ByFile[I] = I;
+        std::stable_sort(ByFile.begin(), ByFile.end(), [&](unsigned A, unsigned B) {
+            return Pool.str(Decls[A].file) < Pool.str(Decls[B].file);
+        });
+
+        for (size_t First = 0, Last; First < ByFile.size(); First = Last) {
+            StrId File = Decls[ByFile[First]].file;
+            for (Last = First + 1;
+                 Last < ByFile.size() && Decls[ByFile[Last]].file == File; ++Last)
+                ;
+            std::optional<sys::fs::UniqueID> ID = fileID(File);
+            if (!ID)
+                continue;
+            // Records from the index, or from a TU with errors, may not be
+            // what a clean walk of the file gives.
+            if (Cache && Index && !Cached && !Failed && !FromCache.count(File) &&
+                !Mixed.count(*ID))
+                offer(*ID, File, ArrayRef(ByFile).slice(First, Last - First));
+            if (!Owners->claim(*ID, Current))
+                continue;
+            for (size_t I = First; I < Last; ++I)
+                render(OS, W, Decls[ByFile[I]]);
+            OS.flush();
+            Chunk.Sections.push_back({*ID, Chunk.Text.size(), Last - First});
+        }
+    }
+
+    void offer(const sys::fs::UniqueID &ID, StrId File, ArrayRef<unsigned> Records) {
+        std::string Key = HeaderCache::key(ID, Directory, Pool.str(File));
+        if (Cache->contains(Key))
+            return;
+        std::string Data;
+        raw_string_ostream OS(Data);
+        support::endian::Writer W(OS, llvm::endianness::little);
+        for (unsigned I : Records)
+            writeDecl(W, Pool, Decls[I]);
+        OS.flush();
+        Cache->put(Key, std::move(Data));
+    }
+
+    // UniqueID of a record's file, looked up once per file and TU; names
+    // are relative to the compile directory. Records without a file have
+    // no ID, rather than the directory's.
+    std::optional<sys::fs::UniqueID> fileID(StrId File) {
+        auto R = FileIDs.try_emplace(File);
+        if (R.second && !Pool.str(File).empty()) {
+            SmallString<256> Abs;
+            if (sys::path::is_relative(Pool.str(File)))
+                Abs = Directory;
+            sys::path::append(Abs, Pool.str(File));
+            sys::fs::UniqueID ID;
+            if (!sys::fs::getUniqueID(Abs, ID))
+                R.first->second = ID;
+        }
+        return R.first->second;
+    }
+
+    void record(ProfileClock::time_point Flushing) {
+        auto Ms = [](ProfileClock::time_point A, ProfileClock::time_point B) {
+            return std::chrono::duration<double, std::milli>(B - A).count();
+        };
+        TUProfile &P = (*Profile)[Current];
+        P = TUProfile();
+        P.Decls = Decls.size();
+        P.Cached = Cached;
+        P.OutputMs = Ms(Flushing, ProfileClock::now());
+        if (Parsing == ProfileClock::time_point()) {
+            // Served from the index, or the compile failed before a
+            // consumer was created.
+            P.SetupMs = Ms(Started, Flushing);
+            return;
+        }
+        P.SetupMs = Ms(Started, Parsing);
+        if (Visiting == ProfileClock::time_point()) {
+            P.ParseMs = Ms(Parsing, Flushing);
+            return;
+        }
+        P.ParseMs = Ms(Parsing, Visiting);
+        P.VisitMs = Ms(Visiting, Flushing);
+    }
+
+    OrderedSink &Sink;
+    DeclIndex *Index;
+    HeaderOwners *Owners;
+    IndexKey Key;
+    std::string Directory;
+    DenseMap<StrId, std::optional<sys::fs::UniqueID>> FileIDs;
+    std::shared_ptr<DependencyCollector> Deps;
+    ArrayRef<std::string> ExtraDeps;
+    StringPool Pool;
+    std::vector<DeclInfo> Decls;
+    unsigned Current = 0;
+    bool Open = false;
+    std::vector<TUProfile> *Profile;
+    SymbolTable *Symbols;
+    HeaderCache *Cache;
+    std::vector<Splice> Spliced;
+    DenseSet<sys::fs::UniqueID> Mixed;
+    ProfileClock::time_point Started, Parsing, Visiting;
+    bool Cached = false;
+    bool Failed = false;
+};
+
+// AST Consumer that creates the visitor
+class DeclConsumer : public ASTConsumer {
+public:
+    explicit DeclConsumer(ASTContext *Context, DeclEmitter &Emitter)
+        : Visitor(Context, Context->getSourceManager(), Emitter.decls(),
+                  Emitter.pool(), Emitter.scope()),
+          Emitter(Emitter) {}
+
+    virtual void HandleTranslationUnit(ASTContext &Context) {
+        Emitter.startVisit();
+        Visitor.TraverseDecl(Context.getTranslationUnitDecl());
+        if (Context.getDiagnostics().hasErrorOccurred())
+            Emitter.fail();
+        Emitter.flush();
+    }
+
+private:
+    DeclVisitor Visitor;
+    DeclEmitter &Emitter;
+};
+
+// Frontend Action that creates the consumer
+class DeclAction : public ASTFrontendAction {
+public:
+    explicit DeclAction(DeclEmitter &Emitter) : Emitter(Emitter) {}
+
+    virtual std::unique_ptr<ASTConsumer> CreateASTConsumer(
+        CompilerInstance &CI, StringRef file) {
+        if (Emitter.indexing()) {
+            auto Deps = std::make_shared<AllDependencyCollector>();
+            Deps->attachToPreprocessor(CI.getPreprocessor());
+            Emitter.setDependencies(Deps);
+        }
+        Emitter.startParse();
+        return std::make_unique<DeclConsumer>(&CI.getASTContext(), Emitter);
+    }
+
+protected:
+    // The visitor only reads declarations, never statements: let the
+    // parser skip function bodies (which also leaves nothing for template
+    // instantiation to do) and drop the warning and typo-correction work.
+    bool BeginInvocation(CompilerInstance &CI) override {
+        if (Fast) {
+            CI.getFrontendOpts().SkipFunctionBodies = true;
+            CI.getLangOpts().SpellChecking = false;
+            CI.getDiagnostics().setIgnoreAllWarnings(true);
+        }
+        return true;
+    }
+
+private:
+    DeclEmitter &Emitter;
+};
+
+// Factory for creating our action
+class DeclActionFactory : public FrontendActionFactory {
+public:
+    explicit DeclActionFactory(DeclEmitter &Emitter) : Emitter(Emitter) {}
+
+    std::unique_ptr<FrontendAction> create() override {
+        return std::make_unique<DeclAction>(Emitter);
+    }
+
+private:
+    DeclEmitter &Emitter;
+};
+
+// The --backend=libclang extractor: clang_indexSourceFile with function
+// bodies skipped and KeepGoing, reporting through the indexer callbacks
+// instead of a RecursiveASTVisitor. It fills the same DeclInfo stream, so
+// everything downstream (filters, index, writers, symbols) is shared.
+//
+// Declarations are rendered from libclang's cursor and type spellings.
+// For C they match the libtooling backend; for C++, libclang prints types
+// with the TU's own language options, so tag types lose their "struct"
+// keyword.
+class LibclangExtractor {
+public:
+    LibclangExtractor()
+        : Idx(clang_createIndex(/*excludeDeclarationsFromPCH=*/0,
+                                /*displayDiagnostics=*/0)),
+          Action(clang_IndexAction_create(Idx)) {}
+
+    ~LibclangExtractor() {
+        clang_IndexAction_dispose(Action);
+        clang_disposeIndex(Idx);
+    }
+
+    // Returns 0 on success, like ClangTool::run.
+    int run(const CompilationDatabase &Compilations, StringRef Path,
+            DeclEmitter &Emitter) {
+        SmallString<256> Abs(Path);
+        sys::fs::make_absolute(Abs);
+        std::vector<CompileCommand> Cmds = Compilations.getCompileCommands(Abs);
+        if (Cmds.empty()) {
+            errs() << "decls: no compile command for " << Path << "\n";
+            return 1;
+        }
+        const CompileCommand &Cmd = Cmds.front();
+        CommandLineArguments Args =
+            getClangStripOutputAdjuster()(Cmd.CommandLine, Cmd.Filename);
+        Args = getClangStripDependencyFileAdjuster()(Args, Cmd.Filename);
+        std::string WorkDir = "-working-directory=" + Cmd.Directory;
+        std::vector<const char *> Argv{WorkDir.c_str()};
+        for (size_t I = 1; I < Args.size(); ++I)  // Args[0] is the compiler
+            Argv.push_back(Args[I].c_str());
+
+        Client C{Emitter, Emitter.scope(), {}, {}, {}, {}};
+        IndexerCallbacks CB = {};
+        CB.diagnostic = diagnostic;
+        CB.indexDeclaration = indexDeclaration;
+        CB.ppIncludedFile = ppIncludedFile;
+        if (Emitter.indexing()) {
+            C.Deps = std::make_shared<AllDependencyCollector>();
+            Emitter.setDependencies(C.Deps);
+        }
+        Emitter.startParse();
+        int Err = clang_indexSourceFile(
+            Action, &C, &CB, sizeof(CB), CXIndexOpt_IndexFunctionLocalSymbols,
+            /*source_filename=*/nullptr, Argv.data(), Argv.size(),
+            /*unsaved_files=*/nullptr, 0, /*out_TU=*/nullptr,
+            CXTranslationUnit_SkipFunctionBodies | CXTranslationUnit_KeepGoing);
+        return Err ? 1 : 0;
+    }
+
+private:
+    struct Client {
+        DeclEmitter &Emitter;
+        FileScope Scope;
+        DenseMap<CXFile, bool> Owned;
+        std::shared_ptr<AllDependencyCollector> Deps;
+        SmallString<256> Buf;
+        std::string Spelling;
+    };
+
+    static StringRef str(Client &C, CXString S) {
+        C.Spelling = clang_getCString(S) ? clang_getCString(S) : "";
+        clang_disposeString(S);
+        return C.Spelling;
+    }
+
+    // KeepGoing parses past errors and still reports success; only the
+    // diagnostics say whether the TU compiled.
+    static void diagnostic(CXClientData Data, CXDiagnosticSet Diags, void *) {
+        auto &C = *static_cast<Client *>(Data);
+        for (unsigned I = 0, N = clang_getNumDiagnosticsInSet(Diags); I < N; ++I) {
+            CXDiagnostic D = clang_getDiagnosticInSet(Diags, I);
+            if (clang_getDiagnosticSeverity(D) >= CXDiagnostic_Error)
+                C.Emitter.fail();
+            clang_disposeDiagnostic(D);
+        }
+    }
+
+    static void ppIncludedFile(CXClientData Data, const CXIdxIncludedFileInfo *Info) {
+        auto &C = *static_cast<Client *>(Data);
+        if (C.Deps && Info->file)
+            C.Deps->add(str(C, clang_getFileName(Info->file)));
+    }
+
+    // The Decl kind DeclVisitor would report for this cursor, if any.
+    static std::optional<Decl::Kind> kindOf(CXCursor Cur) {
+        bool CXX = clang_getCursorLanguage(Cur) == CXLanguage_CPlusPlus;
+        switch (clang_getCursorKind(Cur)) {
+        case CXCursor_FunctionDecl:       return Decl::Function;
+        case CXCursor_CXXMethod:          return Decl::CXXMethod;
+        case CXCursor_Constructor:        return Decl::CXXConstructor;
+        case CXCursor_Destructor:         return Decl::CXXDestructor;
+        case CXCursor_ConversionFunction: return Decl::CXXConversion;
+        case CXCursor_VarDecl:            return Decl::Var;
+        case CXCursor_ParmDecl:           return Decl::ParmVar;
+        case CXCursor_TypedefDecl:        return Decl::Typedef;
+        case CXCursor_StructDecl:
+        case CXCursor_UnionDecl:          return CXX ? Decl::CXXRecord : Decl::Record;
+        case CXCursor_ClassDecl:          return Decl::CXXRecord;
+        case CXCursor_EnumDecl:           return Decl::Enum;
+        case CXCursor_FieldDecl:          return Decl::Field;
+        case CXCursor_EnumConstantDecl:   return Decl::EnumConstant;
+        default:                          return std::nullopt;
+        }
+    }
+
+    static const char *kindName(Decl::Kind K) {
+        switch (K) {
+#define DECL(DERIVED, BASE) case Decl::DERIVED: return #DERIVED;
+#define ABSTRACT_DECL(DECL)
+#include "clang/AST/DeclNodes.inc"
+        }
+        return "";
+    }
+
+    static bool isFunction(Decl::Kind K) {
+        return K >= Decl::firstFunction && K <= Decl::lastFunction;
+    }
+
+    static bool ownsFile(Client &C, CXFile File, CXSourceLocation Loc) {
+        if (!C.Scope.Owners)
+            return clang_Location_isFromMainFile(Loc);
+        auto R = C.Owned.try_emplace(File, false);
+        if (R.second) {
+            CXFileUniqueID ID;
+            R.first->second =
+                File && !clang_getFileUniqueID(File, &ID) &&
+                C.Scope.enter(sys::fs::UniqueID(ID.data[0], ID.data[1]),
+                              str(C, clang_getFileName(File)),
+                              C.Emitter.decls().size());
+        }
+        return R.first->second;
+    }
+
+    static void printType(raw_ostream &OS, Client &C, CXType T) {
+        OS << str(C, clang_getTypeSpelling(T));
+    }
+
+    static void indexDeclaration(CXClientData Data, const CXIdxDeclInfo *Info) {
+        auto &C = *static_cast<Client *>(Data);
+        CXCursor Cur = Info->cursor;
+        std::optional<Decl::Kind> K = kindOf(Cur);
+        if (!K || !Filter.wantsKind(*K))
+            return;
+
+        CXIdxClientFile IdxFile;
+        CXFile File;
+        unsigned Line, Column, Offset;
+        clang_indexLoc_getFileLocation(Info->loc, &IdxFile, &File, &Line, &Column,
+                                       &Offset);
+        if (!ownsFile(C, File, clang_indexLoc_getCXSourceLocation(Info->loc)))
+            return;
+
+        // DeclVisitor only marks functions, records and enums as definitions.
+        bool Definition = Info->isDefinition &&
+                          (isFunction(*K) || *K == Decl::Record ||
+                           *K == Decl::CXXRecord || *K == Decl::Enum);
+        if (DefinitionsOnly && !Definition)
+            return;
+        bool Anonymous = (*K == Decl::Record || *K == Decl::CXXRecord ||
+                          *K == Decl::Enum) && clang_Cursor_isAnonymous(Cur);
+        StringRef Name = Anonymous || !Info->entityInfo->name
+                             ? StringRef() : StringRef(Info->entityInfo->name);
+        if (!Filter.wantsName(Name))
+            return;
+
+        StringPool &Pool = C.Emitter.pool();
+        DeclInfo info;
+        info.kind = Pool.intern(kindName(*K));
+        info.name = Pool.intern(Name);
+        info.is_definition = Definition;
+        info.file = Pool.intern(File ? str(C, clang_getFileName(File)) : StringRef());
+        info.line = Line;
+        info.column = Column;
+        info.usr = 0;
+        if (!SymbolsFile.empty() && *K != Decl::ParmVar && Info->entityInfo->USR &&
+            *Info->entityInfo->USR)
+            info.usr = Pool.intern(Info->entityInfo->USR);
+
+        C.Buf.clear();
+        raw_svector_ostream OS(C.Buf);
+        if (isFunction(*K)) {
+            printType(OS, C, clang_getCursorResultType(Cur));
+            OS << ' ' << Name << '(';
+            int NumArgs = clang_Cursor_getNumArguments(Cur);
+            if (NumArgs <= 0)
+                OS << "void";
+            for (int I = 0; I < NumArgs; ++I) {
+                CXCursor Arg = clang_Cursor_getArgument(Cur, I);
+                if (I > 0)
+                    OS << ", ";
+                printType(OS, C, clang_getCursorType(Arg));
+                StringRef ArgName = str(C, clang_getCursorSpelling(Arg));
+                if (!ArgName.empty())
+                    OS << ' ' << ArgName;
+            }
+            OS << ");";
+        } else if (*K == Decl::Var || *K == Decl::ParmVar || *K == Decl::Field) {
+            printType(OS, C, clang_getCursorType(Cur));
+            OS << ' ' << Name;
+            if (FoldConsts && *K == Decl::Var)
+                printFoldedValue(OS, Cur);
+            OS << ';';
+        } else if (*K == Decl::Typedef) {
+            OS << "typedef ";
+            printType(OS, C, clang_getTypedefDeclUnderlyingType(Cur));
+            OS << ' ' << Name << ';';
+        } else if (*K == Decl::Enum) {
+            OS << "enum " << (Anonymous ? StringRef("<anonymous>") : Name) << ';';
+        } else if (*K == Decl::EnumConstant) {
+            OS << Name << " = ";
+            if (isUnsigned(clang_getEnumDeclIntegerType(clang_getCursorSemanticParent(Cur))))
+                OS << clang_getEnumConstantDeclUnsignedValue(Cur);
+            else
+                OS << clang_getEnumConstantDeclValue(Cur);
+        } else {
+            CXCursorKind CK = clang_getCursorKind(Cur);
+            OS << (CK == CXCursor_UnionDecl ? "union "
+                   : CK == CXCursor_ClassDecl ? "class " : "struct ")
+               << (Anonymous ? StringRef("<anonymous>") : Name) << ';';
+        }
+        info.declaration = Pool.intern(C.Buf.str());
+        C.Emitter.decls().push_back(info);
+    }
+
+    static bool isUnsigned(CXType T) {
+        switch (clang_getCanonicalType(T).kind) {
+        case CXType_Bool:
+        case CXType_Char_U:
+        case CXType_UChar:
+        case CXType_UShort:
+        case CXType_UInt:
+        case CXType_ULong:
+        case CXType_ULongLong:
+        case CXType_UInt128:
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    // --fold-consts for file-scope const integers. libclang's evaluator
+    // has no APValue printer, so floating values are left out here.
+    static void printFoldedValue(raw_ostream &OS, CXCursor Cur) {
+        CXType T = clang_getCursorType(Cur);
+        CXCursorKind Parent = clang_getCursorKind(clang_getCursorSemanticParent(Cur));
+        if (!clang_isConstQualifiedType(T) || Parent == CXCursor_FunctionDecl ||
+            Parent == CXCursor_CXXMethod)
+            return;
+        CXEvalResult R = clang_Cursor_Evaluate(Cur);
+        if (!R)
+            return;
+        if (clang_EvalResult_getKind(R) == CXEval_Int) {
+            OS << " = ";
+            if (clang_EvalResult_isUnsignedInt(R))
+                OS << clang_EvalResult_getAsUnsigned(R);
+            else
+                OS << clang_EvalResult_getAsLongLong(R);
+        }
+        clang_EvalResult_dispose(R);
+    }
+
+    CXIndex Idx;
+    CXIndexAction Action;
+};
+
+// Estimated cost of each TU, for starting the slowest ones first: a large
+// TU that starts last stretches the whole run. TUs seen before cost what
+// they took last time; new ones are priced by main file size, at the
+// average microseconds per byte of the TUs that do have a history.
+//
+// File format: one "usec<TAB>absolute-path" line per TU. Entries for TUs
+// outside this run are carried over.
+class TUTimings {
+public:
+    explicit TUTimings(ArrayRef<std::string> Paths) : Usec(Paths.size()) {
+        for (const std::string &Path : Paths) {
+            SmallString<256> Abs(Path);
+            sys::fs::make_absolute(Abs);
+            sys::path::remove_dots(Abs, /*remove_dot_dot=*/true);
+            Keys.push_back(Abs.str().str());
+        }
+    }
+
+    void load(StringRef File) {
+        auto Buf = MemoryBuffer::getFile(File);
+        if (!Buf)
+            return;
+        SmallVector<StringRef, 0> Lines;
+        (*Buf)->getBuffer().split(Lines, '\n', -1, /*KeepEmpty=*/false);
+        for (StringRef Line : Lines) {
+            auto [Time, Path] = Line.split('\t');
+            uint64_t T;
+            if (!Path.empty() && !Time.getAsInteger(10, T))
+                Previous[Path] = T;
+        }
+    }
+
+    // TU indices, most expensive first.
+    std::vector<unsigned> order() const {
+        std::vector<uint64_t> Size(Keys.size());
+        uint64_t KnownUsec = 0, KnownBytes = 0;
+        for (size_t TU = 0; TU < Keys.size(); ++TU) {
+            sys::fs::file_status St;
+            if (!sys::fs::status(Keys[TU], St))
+                Size[TU] = St.getSize();
+            auto It = Previous.find(Keys[TU]);
+            if (It != Previous.end() && Size[TU]) {
+                KnownUsec += It->second;
+                KnownBytes += Size[TU];
+            }
+        }
+        double PerByte = KnownBytes ? double(KnownUsec) / KnownBytes : 1.0;
+
+        std::vector<double> Cost(Keys.size());
+        for (size_t TU = 0; TU < Keys.size(); ++TU) {
+            auto It = Previous.find(Keys[TU]);
+            Cost[TU] = It != Previous.end() ? It->second : Size[TU] * PerByte;
+        }
+        std::vector<unsigned> Order(Keys.size());
+        for (unsigned TU = 0; TU < Order.size(); ++TU)
+            Order[TU] = TU;
+        std::stable_sort(Order.begin(), Order.end(),
+                         [&](unsigned A, unsigned B) { return Cost[A] > Cost[B]; });
+        return Order;
+    }
+
+    // Called by the worker that parsed TU; each TU has its own slot.
+    void record(unsigned TU, uint64_t Micros) { Usec[TU] = Micros; }
+
+    void save(StringRef File) {
+        // TUs served from the index were not timed; keep what they took
+        // when they were last parsed.
+        for (size_t TU = 0; TU < Keys.size(); ++TU)
+            if (Usec[TU])
+                Previous[Keys[TU]] = Usec[TU];
+
+        std::vector<std::pair<StringRef, uint64_t>> Entries;
+        for (const auto &E : Previous)
+            Entries.emplace_back(E.getKey(), E.getValue());
+        llvm::sort(Entries);
+
+        std::string Tmp = (File + ".tmp").str();
+        {
+            std::error_code EC;
+            raw_fd_ostream OS(Tmp, EC);
+            if (EC)
+                return;
+            for (const auto &E : Entries)
+                OS << E.second << "\t" << E.first << "\n";
+            if (OS.has_error()) {
+                OS.clear_error();
+                sys::fs::remove(Tmp);
+                return;
+            }
+        }
+        sys::fs::rename(Tmp, File);
+    }
+
+private:
+    std::vector<std::string> Keys;
+    std::vector<uint64_t> Usec;
+    StringMap<uint64_t> Previous;
+};
+
+// Hands out TUs most expensive first, but only from the Window TUs in
+// source-path order that follow the last one written. A TU that finishes
+// early is held by the sink until every TU before it is written, so this
+// bounds how many chunks can be pending at once. A worker that finds
+// nothing left in the window waits for the sink to move it on; the TU the
+// sink waits for is always in the window and already taken, so it will.
+class TUWindow {
+public:
+    TUWindow(ArrayRef<unsigned> Order, unsigned Window)
+        : Rank(Order.size()), Window(Window) {
+        for (unsigned I = 0; I < Order.size(); ++I)
+            Rank[Order[I]] = I;
+        admit();
+    }
+
+    bool next(unsigned &TU) {
+        std::unique_lock<std::mutex> Guard(Lock);
+        Ready.wait(Guard, [&] { return !Queue.empty() || Admitted == Rank.size(); });
+        if (Queue.empty())
+            return false;
+        TU = Queue.begin()->second;
+        Queue.erase(Queue.begin());
+        return true;
+    }
+
+    // Every TU before Done has been written.
+    void written(unsigned Done) {
+        {
+            std::lock_guard<std::mutex> Guard(Lock);
+            this->Done = Done;
+            admit();
+        }
+        Ready.notify_all();
+    }
+
+private:
+    void admit() {
+        for (; Admitted < Rank.size() && Admitted < Done + Window; ++Admitted)
+            Queue.emplace(Rank[Admitted], Admitted);
+    }
+
+    std::mutex Lock;
+    std::condition_variable Ready;
+    std::vector<unsigned> Rank;  // position in cost order, per TU
+    std::set<std::pair<unsigned, unsigned>> Queue;  // admitted, by (rank, TU)
+    unsigned Window;
+    unsigned Admitted = 0;  // TUs before this one have been admitted
+    unsigned Done = 0;
+};
+
+// Work-stealing scheduler for the PCH builds (TUs go through TUWindow):
+// every worker owns a deque of PCH group indices, pops from its own front
+// and, once that runs dry, steals from the back of the other workers'
+// deques.
+class PchScheduler {
+public:
+    explicit PchScheduler(unsigned NumWorkers) : Queues(NumWorkers) {}
+
+    void push(unsigned Worker, unsigned TU) {
+        Queues[Worker].Jobs.push_back(TU);
+    }
+
+    bool next(unsigned Worker, unsigned &TU) {
+        {
+            Queue &Own = Queues[Worker];
+            std::lock_guard<std::mutex> Guard(Own.Lock);
+            if (!Own.Jobs.empty()) {
+                TU = Own.Jobs.front();
+                Own.Jobs.pop_front();
+                return true;
+            }
+        }
+        for (unsigned I = 1; I < Queues.size(); ++I) {
+            Queue &Victim = Queues[(Worker + I) % Queues.size()];
+            std::lock_guard<std::mutex> Guard(Victim.Lock);
+            if (!Victim.Jobs.empty()) {
+                TU = Victim.Jobs.back();
+                Victim.Jobs.pop_back();
+                return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    struct Queue {
+        std::mutex Lock;
+        std::deque<unsigned> Jobs;
+    };
+    std::vector<Queue> Queues;
+};
+
+// Everything the workers share for one run.
+struct RunContext {
+    const CompilationDatabase &Compilations;
+    const std::vector<std::string> &Paths;
+    OrderedSink &Sink;
+    DeclIndex *Index;
+    PchPlanner *Pch;
+    HeaderOwners *Owners;
+    TUTimings &Timings;
+    std::vector<TUProfile> *Profile;
+    SymbolTable *Symbols;
+    HeaderCache *Headers;
+};
+
+static int runWorker(TUWindow &Scheduler, const RunContext &Run) {
+    DeclEmitter Emitter(Run.Sink, Run.Index, Run.Owners, Run.Profile, Run.Symbols,
+                        Run.Headers);
+    DeclActionFactory Factory(Emitter);
+    std::unique_ptr<LibclangExtractor> Libclang;
+    if (BackendKind == Backend::Libclang)
+        Libclang = std::make_unique<LibclangExtractor>();
+    int Result = 0;
+    unsigned TU;
+    while (Scheduler.next(TU)) {
+        // Only main files can match --file here: skip the parse.
+        if (!Run.Owners && !Filter.wantsFile(Run.Paths[TU])) {
+            Run.Sink.submit(TU, TUChunk());
+            continue;
+        }
+        const PchGroup *Pch = Run.Pch ? Run.Pch->groupFor(TU) : nullptr;
+        if (Emitter.begin(TU, Run.Paths[TU], Run.Compilations,
+                          Pch ? ArrayRef(Pch->Deps) : ArrayRef<std::string>()))
+            continue;
+
+        // Each run gets its own CompilerInstance from ClangTool; the file
+        // system is private too, since ClangTool changes its working
+        // directory per compile command.
+        auto Start = std::chrono::steady_clock::now();
+        int TUResult;
+        if (Libclang) {
+            TUResult = Libclang->run(Run.Compilations, Run.Paths[TU], Emitter);
+        } else {
+            IntrusiveRefCntPtr<vfs::FileSystem> FS = vfs::createPhysicalFileSystem();
+            ClangTool Tool(Run.Compilations, Run.Paths[TU],
+                           std::make_shared<PCHContainerOperations>(), FS);
+            if (Pch)
+                Tool.appendArgumentsAdjuster(getInsertArgumentAdjuster(
+                    {"-include-pch", Pch->Pch}, ArgumentInsertPosition::BEGIN));
+            TUResult = Tool.run(&Factory);
+        }
+        Result = std::max(Result, TUResult);
+        if (TUResult)
+            Emitter.fail();
+        // TUs that never reached HandleTranslationUnit still owe the sink
+        // an (empty) chunk, or everything after them would stall.
+        Emitter.flush();
+        Run.Timings.record(TU, std::chrono::duration_cast<std::chrono::microseconds>(
+                                   std::chrono::steady_clock::now() - Start).count());
+    }
+    return Result;
+}
+
+// Writes the --profile report: one object per TU in source-path order,
+// then run-wide totals. Times are milliseconds; peak RSS is the process
+// high-water mark in kilobytes.
+static bool writeProfile(StringRef File, ArrayRef<std::string> Paths,
+                         ArrayRef<TUProfile> Profile, unsigned NumWorkers,
+                         double WallMs) {
+    std::error_code EC;
+    raw_fd_ostream OS(File, EC);
+    if (EC) {
+        errs() << "decls: cannot open " << File << ": " << EC.message() << "\n";
+        return false;
+    }
+    TUProfile Sum;
+    size_t Cached = 0;
+    for (const TUProfile &P : Profile) {
+        Sum.SetupMs += P.SetupMs;
+        Sum.ParseMs += P.ParseMs;
+        Sum.VisitMs += P.VisitMs;
+        Sum.OutputMs += P.OutputMs;
+        Sum.Decls += P.Decls;
+        Cached += P.Cached;
+    }
+    auto PerSec = [](size_t N, double Ms) { return Ms > 0 ? N * 1000.0 / Ms : 0.0; };
+    struct rusage RU;
+    getrusage(RUSAGE_SELF, &RU);
+
+    json::OStream J(OS, 2);
+    J.object([&] {
+        J.attribute("version", 1);
+        J.attributeArray("tus", [&] {
+            for (size_t TU = 0; TU < Profile.size(); ++TU) {
+                const TUProfile &P = Profile[TU];
+                double Total = P.SetupMs + P.ParseMs + P.VisitMs + P.OutputMs;
+                J.object([&] {
+                    J.attribute("path", Paths[TU]);
+                    J.attribute("cached", P.Cached);
+                    J.attribute("setup_ms", P.SetupMs);
+                    J.attribute("parse_ms", P.ParseMs);
+                    J.attribute("visit_ms", P.VisitMs);
+                    J.attribute("output_ms", P.OutputMs);
+                    J.attribute("total_ms", Total);
+                    J.attribute("decls", int64_t(P.Decls));
+                    J.attribute("decls_per_sec", PerSec(P.Decls, Total));
+                });
+            }
+        });
+        J.attributeObject("total", [&] {
+            J.attribute("tus", int64_t(Profile.size()));
+            J.attribute("cached", int64_t(Cached));
+            J.attribute("workers", int64_t(NumWorkers));
+            J.attribute("wall_ms", WallMs);
+            J.attribute("setup_ms", Sum.SetupMs);
+            J.attribute("parse_ms", Sum.ParseMs);
+            J.attribute("visit_ms", Sum.VisitMs);
+            J.attribute("output_ms", Sum.OutputMs);
+            J.attribute("decls", int64_t(Sum.Decls));
+            J.attribute("decls_per_sec", PerSec(Sum.Decls, WallMs));
+            J.attribute("peak_rss_kb", int64_t(RU.ru_maxrss));
+        });
+    });
+    OS << "\n";
+    return !OS.has_error();
+}
+
+// Server mode (--serve). Requests come one per line over a Unix socket:
+//
+//   DECLS <path>   declarations of <path>, one per line as in text output,
+//                  then an empty line; failures answer "ERROR <reason>"
+//                  followed by an empty line
+//   QUIT           close this connection
+//   SHUTDOWN       stop the server
+//
+// Parsed ASTs stay in an LRU cache keyed by file and compile command. A
+// cached AST is reparsed when its main file or anything it includes has
+// changed; it is built with a precompiled preamble, so a reparse after an
+// edit below the #includes does not parse the headers again. Clients are
+// served one at a time.
+
+// Builds an ASTUnit that can be reparsed, rather than a one-shot AST.
+class ASTUnitLoader : public ToolAction {
+public:
+    bool runInvocation(std::shared_ptr<CompilerInvocation> Invocation,
+                       FileManager *Files,
+                       std::shared_ptr<PCHContainerOperations> PCHContainerOps,
+                       DiagnosticConsumer *DiagConsumer) override {
+        // Keep the #include directives, to know what to watch.
+        Invocation->getPreprocessorOpts().DetailedRecord = true;
+        if (Fast)
+            Invocation->getFrontendOpts().SkipFunctionBodies = true;
+        AST = ASTUnit::LoadFromCompilerInvocation(
+            Invocation, std::move(PCHContainerOps),
+            CompilerInstance::createDiagnostics(&Invocation->getDiagnosticOpts(),
+                                                DiagConsumer,
+                                                /*ShouldOwnClient=*/false),
+            Files, /*OnlyLocalDecls=*/false, CaptureDiagsKind::None,
+            /*PrecompilePreambleAfterNParses=*/1, TU_Complete,
+            /*CacheCodeCompletionResults=*/false,
+            /*IncludeBriefCommentsInCodeCompletion=*/false,
+            /*UserFilesAreVolatile=*/true);
+        return AST != nullptr;
+    }
+
+    std::unique_ptr<ASTUnit> AST;
+};
+
+class ASTCache {
+public:
+    ASTCache(const CompilationDatabase &Compilations, unsigned Capacity)
+        : Compilations(Compilations), Capacity(std::max(1u, Capacity)) {}
+
+    // Renders the declarations of Path into OS; false (with Error set) if
+    // it could not be parsed.
+    bool query(StringRef Path, raw_ostream &OS, std::string &Error) {
+        SmallString<256> Abs(Path);
+        sys::fs::make_absolute(Abs);
+        sys::path::remove_dots(Abs, /*remove_dot_dot=*/true);
+        std::string Directory;
+        uint64_t Flags = hashCompileCommands(Compilations, Abs, Directory);
+        std::string Key = Abs.str().str();
+        Key += '\0';
+        Key += utohexstr(Flags);
+
+        Entry *E = lookup(Key);
+        if (E && stale(*E)) {
+            if (E->AST->Reparse(std::make_shared<PCHContainerOperations>())) {
+                drop(Key);
+                E = nullptr;
+            } else {
+                watch(*E);
+            }
+        }
+        if (!E) {
+            E = load(Key, Abs, Directory);
+            if (!E) {
+                Error = "cannot parse " + Abs.str().str();
+                return false;
+            }
+        }
+
+        StringPool Pool;
+        std::vector<DeclInfo> Decls;
+        DeclVisitor Visitor(&E->AST->getASTContext(), E->AST->getSourceManager(),
+                            Decls, Pool);
+        // The main file's own top-level declarations; walking the whole
+        // TU would pull every preamble declaration back in.
+        for (auto It = E->AST->top_level_begin(); It != E->AST->top_level_end(); ++It)
+            Visitor.TraverseDecl(*It);
+        for (const DeclInfo &decl : Decls)
+            printDecl(OS, Pool, decl, /*WithFile=*/false);
+        return true;
+    }
+
+private:
+    struct Input {
+        std::string Path;
+        uint64_t Size;
+        uint64_t MTime;
+    };
+    struct Entry {
+        std::string Key;
+        std::unique_ptr<ASTUnit> AST;
+        std::string Directory;
+        std::vector<Input> Inputs;
+    };
+
+    Entry *lookup(StringRef Key) {
+        auto It = Index.find(Key);
+        if (It == Index.end())
+            return nullptr;
+        LRU.splice(LRU.begin(), LRU, It->second);
+        return &*It->second;
+    }
+
+    void drop(StringRef Key) {
+        auto It = Index.find(Key);
+        LRU.erase(It->second);
+        Index.erase(It);
+    }
+
+    Entry *load(const std::string &Key, StringRef Path, StringRef Directory) {
+        IntrusiveRefCntPtr<vfs::FileSystem> FS = vfs::createPhysicalFileSystem();
+        ClangTool Tool(Compilations, Path, std::make_shared<PCHContainerOperations>(), FS);
+        ASTUnitLoader Loader;
+        if (Tool.run(&Loader) || !Loader.AST)
+            return nullptr;
+
+        LRU.push_front(Entry{Key, std::move(Loader.AST), Directory.str(), {}});
+        Index[Key] = LRU.begin();
+        if (LRU.size() > Capacity) {
+            Index.erase(LRU.back().Key);
+            LRU.pop_back();
+        }
+        watch(LRU.front());
+        return &LRU.front();
+    }
+
+    // Records the size and mtime of the main file and of every file it
+    // includes, directly or not, as of the parse just done.
+    void watch(Entry &E) {
+        E.Inputs.clear();
+        auto add = [&](StringRef Name) {
+            SmallString<256> Abs;
+            if (sys::path::is_relative(Name))
+                Abs = E.Directory;
+            sys::path::append(Abs, Name);
+            sys::fs::file_status St;
+            bool Exists = !sys::fs::status(Abs, St);
+            E.Inputs.push_back({Abs.str().str(), Exists ? St.getSize() : 0,
+                                Exists ? mtime(St) : 0});
+        };
+        SourceManager &SM = E.AST->getSourceManager();
+        if (OptionalFileEntryRef Main = SM.getFileEntryRefForID(SM.getMainFileID()))
+            add(Main->getName());
+        if (PreprocessingRecord *PPRec = E.AST->getPreprocessor().getPreprocessingRecord())
+            for (PreprocessedEntity *PE : *PPRec)
+                if (auto *ID = dyn_cast_or_null<InclusionDirective>(PE))
+                    if (OptionalFileEntryRef FE = ID->getFile())
+                        add(FE->getName());
+    }
+
+    static uint64_t mtime(const sys::fs::file_status &St) {
+        return St.getLastModificationTime().time_since_epoch().count();
+    }
+
+    bool stale(const Entry &E) {
+        for (const Input &In : E.Inputs) {
+            sys::fs::file_status St;
+            if (sys::fs::status(In.Path, St) || St.getSize() != In.Size ||
+                mtime(St) != In.MTime)
+                return true;
+        }
+        return false;
+    }
+
+    const CompilationDatabase &Compilations;
+    unsigned Capacity;
+    std::list<Entry> LRU;
+    StringMap<std::list<Entry>::iterator> Index;
+};
+
+static bool writeAll(int Fd, StringRef Data) {
+    while (!Data.empty()) {
+        ssize_t N = ::write(Fd, Data.data(), Data.size());
+        if (N < 0 && errno == EINTR)
+            continue;
+        if (N <= 0)
+            return false;
+        Data = Data.drop_front(N);
+    }
+    return true;
+}
+
+static int serve(const CompilationDatabase &Compilations, StringRef SocketPath) {
+    sockaddr_un Addr = {};
+    Addr.sun_family = AF_UNIX;
+    if (SocketPath.size() >= sizeof(Addr.sun_path)) {
+        errs() << "decls: socket path too long: " << SocketPath << "\n";
+        return 1;
+    }
+    memcpy(Addr.sun_path, SocketPath.data(), SocketPath.size());
+
+    // A socket left by an earlier server is replaced; anything else at the
+    // path is not ours to delete.
+    struct stat St;
+    if (::lstat(Addr.sun_path, &St) == 0) {
+        if (!S_ISSOCK(St.st_mode)) {
+            errs() << "decls: " << SocketPath << " exists and is not a socket\n";
+            return 1;
+        }
+        ::unlink(Addr.sun_path);
+    }
+
+    int Listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (Listener < 0 || bind(Listener, (sockaddr *)&Addr, sizeof(Addr)) < 0 ||
+        listen(Listener, 8) < 0) {
+        errs() << "decls: cannot listen on " << SocketPath << ": "
+               << sys::StrError() << "\n";
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    ASTCache Cache(Compilations, CacheSize);
+    bool Running = true;
+    while (Running) {
+        int Client = accept(Listener, nullptr, nullptr);
+        if (Client < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        std::string In;
+        char Buf[4096];
+        bool Open = true;
+        while (Open) {
+            size_t NL = In.find('\n');
+            if (NL == std::string::npos) {
+                ssize_t N = ::read(Client, Buf, sizeof(Buf));
+                if (N < 0 && errno == EINTR)
+                    continue;
+                if (N <= 0)
+                    break;
+                In.append(Buf, N);
+                continue;
+            }
+            StringRef Line = StringRef(In).take_front(NL).rtrim("\r");
+            std::string Reply;
+            raw_string_ostream OS(Reply);
+            if (Line == "QUIT") {
+                Open = false;
+            } else if (Line == "SHUTDOWN") {
+                Open = Running = false;
+            } else if (Line.consume_front("DECLS ")) {
+                std::string Error;
+                if (!Cache.query(Line.trim(), OS, Error))
+                    OS << "ERROR " << Error << "\n";
+                OS << "\n";
+            } else {
+                OS << "ERROR unknown request\n\n";
+            }
+            In.erase(0, NL + 1);
+            if (!writeAll(Client, Reply))
+                Open = false;
+        }
+        ::close(Client);
+    }
+    ::close(Listener);
+    ::unlink(Addr.sun_path);
+    return 0;
+}
+
+// Runs Body(Worker) on NumWorkers threads, the calling thread being
+// worker 0, and returns once all of them have.
+template <typename Fn>
+static void runOnWorkers(unsigned NumWorkers, Fn Body) {
+    std::vector<std::thread> Threads;
+    for (unsigned W = 1; W < NumWorkers; ++W)
+        Threads.emplace_back([&Body, W] { Body(W); });
+    Body(0);
+    for (auto &T : Threads)
+        T.join();
+}
+
+// CommonOptionsParser only loads a compilation database when it is given
+// source paths. Without them, load the one -p names here (or the nearest
+// one above the working directory).
+static std::unique_ptr<CompilationDatabase> loadCompilations() {
+    std::string BuildPath = ".";
+    StringMap<cl::Option *> &Options = cl::getRegisteredOptions();
+    auto It = Options.find("p");
+    if (It != Options.end()) {
+        auto *P = static_cast<cl::opt<std::string> *>(It->second);
+        if (!P->getValue().empty())
+            BuildPath = P->getValue();
+    }
+    std::string Error;
+    std::unique_ptr<CompilationDatabase> Compilations =
+        CompilationDatabase::autoDetectFromDirectory(BuildPath, Error);
+    if (!Compilations)
+        errs() << "decls: no compilation database in " << BuildPath << ": " << Error << "\n";
+    return Compilations;
+}
+
+int main(int argc, const char **argv) {
+    // Source paths are optional: without them every file in the
+    // compilation database is processed.
+    auto ExpectedParser = CommonOptionsParser::create(argc, argv, ToolCategory,
+                                                      cl::ZeroOrMore);
+    if (!ExpectedParser) {
+        llvm::errs() << ExpectedParser.takeError();
+        return 1;
+    }
+    CommonOptionsParser &OptionsParser = ExpectedParser.get();
+    std::unique_ptr<CompilationDatabase> Database;
+    if (OptionsParser.getSourcePathList().empty()) {
+        Database = loadCompilations();
+        if (!Database)
+            return 1;
+    }
+    const CompilationDatabase &Compilations =
+        Database ? *Database : OptionsParser.getCompilations();
+    
+    if (!Filter.init())
+        return 1;
+    if (Layout && BackendKind == Backend::Libclang) {
+        errs() << "decls: --layout needs the libtooling backend\n";
+        return 1;
+    }
+    if (!ServeSocket.empty())
+        return serve(Compilations, ServeSocket);
+
+    std::vector<std::string> Paths = OptionsParser.getSourcePathList();
+    if (Paths.empty()) {
+        Paths = Compilations.getAllFiles();
+        llvm::sort(Paths);
+    }
+    if (Paths.empty()) {
+        errs() << "decls: no input files\n";
+        return 1;
+    }
+
+    unsigned NumWorkers = Jobs ? unsigned(Jobs)
+                               : hardware_concurrency().compute_thread_count();
+    NumWorkers = std::max(1u, std::min<unsigned>(NumWorkers, Paths.size()));
+
+    // Start the TUs slowest first, so the cheap ones fill in the tail, but
+    // only within a window past the last TU written: output stays in
+    // source-path order and at most Window TUs wait to be written.
+    std::string TimingsPath = TimingsFile;
+    if (TimingsPath.empty() && !IndexDir.empty())
+        TimingsPath = IndexDir + "/timings";
+    TUTimings Timings(Paths);
+    if (!TimingsPath.empty())
+        Timings.load(TimingsPath);
+    TUWindow Scheduler(Timings.order(), 4 * NumWorkers);
+
+    if (Format == OutputFormat::Binary && (OutputFile.empty() || OutputFile == "-")) {
+        errs() << "decls: --format=bin needs a seekable output file (-o)\n";
+        return 1;
+    }
+    std::error_code EC;
+    raw_fd_ostream OS(OutputFile.empty() ? "-" : OutputFile, EC);
+    if (EC) {
+        errs() << "decls: cannot open " << OutputFile << ": " << EC.message() << "\n";
+        return 1;
+    }
+    OS.SetBufferSize(1 << 16);
+
+    std::unique_ptr<DeclWriter> Out;
+    if (Format == OutputFormat::Binary)
+        Out = std::make_unique<BinaryWriter>(OS);
+    else
+        Out = std::make_unique<TextWriter>(OS);
+    Out->begin(Paths);
+
+    FileStamps Stamps;
+    std::unique_ptr<DeclIndex> Index;
+    if (!IndexDir.empty()) {
+        Index = std::make_unique<DeclIndex>(IndexDir, Stamps);
+        if (!Index->init())
+            return 1;
+    }
+
+    std::unique_ptr<PchPlanner> Pch;
+    if (!PchDir.empty()) {
+        Pch = std::make_unique<PchPlanner>(PchDir, Stamps);
+        if (!Pch->init())
+            return 1;
+        Pch->plan(Compilations, Paths);
+        PchScheduler Builds(NumWorkers);
+        for (unsigned G = 0; G < Pch->size(); ++G)
+            Builds.push(G % NumWorkers, G);
+        runOnWorkers(NumWorkers, [&](unsigned W) {
+            unsigned G;
+            while (Builds.next(W, G))
+                Pch->build(G);
+        });
+    }
+
+    std::vector<TUProfile> Profile;
+    if (!ProfileFile.empty())
+        Profile.resize(Paths.size());
+    auto RunStart = ProfileClock::now();
+
+    HeaderOwners Owners;
+    HeaderCache Headers;
+    SymbolTable Symbols;
+    OrderedSink Sink(*Out, IncludeHeaders ? &Owners : nullptr);
+    Sink.Written = [&](unsigned Done) { Scheduler.written(Done); };
+    RunContext Run{Compilations, Paths, Sink, Index.get(),
+                   Pch.get(), IncludeHeaders ? &Owners : nullptr, Timings,
+                   ProfileFile.empty() ? nullptr : &Profile,
+                   SymbolsFile.empty() ? nullptr : &Symbols, &Headers};
+    std::vector<int> Results(NumWorkers);
+    runOnWorkers(NumWorkers, [&](unsigned W) {
+        Results[W] = runWorker(Scheduler, Run);
+    });
+
+    int Result = *std::max_element(Results.begin(), Results.end());
+    if (!TimingsPath.empty())
+        Timings.save(TimingsPath);
+    if (!SymbolsFile.empty() && !Symbols.write(SymbolsFile))
+        Result = 1;
+    if (!ProfileFile.empty() &&
+        !writeProfile(ProfileFile, Paths, Profile, NumWorkers,
+                      std::chrono::duration<double, std::milli>(
+                          ProfileClock::now() - RunStart).count()))
+        Result = 1;
+
+    if (ShowStats) {
+        uint64_t Hits = Stats.TypeHits, Misses = Stats.TypeMisses;
+        errs() << "decls: type spellings: " << Hits << " hits, " << Misses
+               << " misses ("
+               << format("%.1f%%", Hits + Misses ? 100.0 * Hits / (Hits + Misses) : 0.0)
+               << " hit rate)\n";
+    }
+
+#ifdef DECLS_COUNT_ALLOCS
+    uint64_t Rendered = RenderedDecls, Allocs = RenderAllocs;
+    errs() << "decls: " << Rendered << " declarations rendered, " << Allocs
+           << " allocations (" << format("%.3f", Rendered ? double(Allocs) / Rendered : 0.0)
+           << " per declaration)\n";
+#endif
+
+    if (!Out->finish(Sink.total())) {
+        errs() << "decls: error writing output\n";
+        OS.clear_error();
+        return 1;
     }
-    
-    std::cout << "\n=== Total: " << Decls.size() << " items ===\n";
     
     return Result;
 }
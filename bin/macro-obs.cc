@@ -9,17 +9,51 @@
  * 
  * Outputs unchanged source to stdout (null transformer)
  * 
+ * Reports are text, JSON Lines or a binary record stream (--format),
+ * rendered per file into one buffer and written in large blocks.
+ * 
+ * Takes any number of files, or every file of a compilation database
+ * (-p), parsed in parallel; reports come out in input order.
+ * 
+ * With --db, also writes every definition (location and body hash) and
+ * every expansion site to a macro database (inc/macrodb.hh), which
+ * --expanded and --conflicts then query without parsing anything.
+ * 
+ * With --watch, keeps the translation unit and reparses it whenever the
+ * file or anything it includes is saved, reporting only the macro
+ * definitions that were added, removed or changed.
+ * 
  * Compile:
- *   g++ -std=c++17 -I./include macro_observer.cpp -o macro_observer -L./lib -lclang
+ *   g++ -std=c++17 -I./include -Iinc macro_observer.cpp -o macro_observer -L./lib -lclang -pthread
  */
 //   
 #include <clang-c/Index.h>
+#include "macrodb.hh"
 #include <iostream>
-#include <fstream>
 #include <vector>
 #include <string>
+#include <string_view>
+#include <algorithm>
+#include <cctype>
 #include <cstring>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <atomic>
+#include <charconv>
+#include <filesystem>
 #include <map>
+#include <mutex>
+#include <set>
+#include <memory>
+#include <thread>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #define test test
 using namespace std;
 // Helper to convert CXString to string
@@ -30,11 +64,7 @@ string fromCXString(CXString cxstr) {
 }
 
 // Helper to get source location info
-string getLocation(CXSourceLocation loc) {
-    CXFile file;
-    unsigned line, column, offset;
-    clang_getFileLocation(loc, &file, &line, &column, &offset);
-    
+string getLocation(CXFile file, unsigned line, unsigned column) {
     if (file) {
         string filename = fromCXString(clang_getFileName(file));
         return filename + ":" + to_string(line) + ":" + to_string(column);
@@ -42,27 +72,501 @@ string getLocation(CXSourceLocation loc) {
     return "<unknown>";
 }
 
-// Get the source text for a range
-string getSourceText(CXTranslationUnit tu, CXSourceRange range) {
-    CXToken *tokens = nullptr;
-    unsigned numTokens = 0;
-    clang_tokenize(tu, range, &tokens, &numTokens);
-    
-    string result;
-    for (unsigned i = 0; i < numTokens; i++) {
-        result += fromCXString(clang_getTokenSpelling(tu, tokens[i]));
-        if (i < numTokens - 1) result += " ";
+// Get the source text for a range, straight out of the file buffer clang
+// already holds; nothing is copied, and the view lives as long as the TU.
+// Empty when the range is not within one file (built-in macros).
+string_view getSourceText(CXTranslationUnit tu, CXSourceRange range) {
+    CXFile file, endFile;
+    unsigned begin, end;
+    clang_getFileLocation(clang_getRangeStart(range), &file, nullptr, nullptr, &begin);
+    clang_getFileLocation(clang_getRangeEnd(range), &endFile, nullptr, nullptr, &end);
+    if (!file || !clang_File_isEqual(file, endFile) || end < begin) {
+        return {};
+    }
+    size_t size;
+    const char* contents = clang_getFileContents(tu, file, &size);
+    if (!contents || end > size) {
+        return {};
+    }
+    return string_view(contents + begin, end - begin);
+}
+
+// Appends source text to out the way the preprocessor reads it: line
+// continuations are spliced out, and comments and runs of whitespace
+// become a single space. String and character literals are copied as is.
+// Done only when a definition is printed or compared.
+void normalizeSourceText(string_view text, string& out) {
+    size_t start = out.size();
+    bool space = false;
+    size_t i = 0;
+    while (i < text.size()) {
+        char c = text[i];
+        if (c == '\\' && i + 1 < text.size() && (text[i + 1] == '\n' || text[i + 1] == '\r')) {
+            i += (text[i + 1] == '\r' && i + 2 < text.size() && text[i + 2] == '\n') ? 3 : 2;
+            continue;
+        }
+        if (c == '/' && i + 1 < text.size() && text[i + 1] == '*') {
+            size_t close = text.find("*/", i + 2);
+            i = close == string_view::npos ? text.size() : close + 2;
+            space = true;
+            continue;
+        }
+        if (c == '/' && i + 1 < text.size() && text[i + 1] == '/') {
+            size_t eol = text.find('\n', i + 2);
+            i = eol == string_view::npos ? text.size() : eol;
+            space = true;
+            continue;
+        }
+        if (isspace((unsigned char)c)) {
+            space = true;
+            i++;
+            continue;
+        }
+        if (space && out.size() > start) {
+            out += ' ';
+        }
+        space = false;
+        // A quote after a digit or letter is a C++14 digit separator.
+        bool literal = c == '"' || (c == '\'' && (i == 0 || !isalnum((unsigned char)text[i - 1])));
+        if (!literal) {
+            out += c;
+            i++;
+            continue;
+        }
+        size_t j = i + 1;
+        while (j < text.size() && text[j] != c) {
+            j += text[j] == '\\' ? 2 : 1;
+        }
+        j = min(j + 1, text.size());
+        out.append(text.data() + i, j - i);
+        i = j;
     }
-    
-    clang_disposeTokens(tu, tokens, numTokens);
-    return result;
 }
 
+// One preprocessor construct, as handed to a Sink.
+struct Event {
+    enum Kind { Define, Expansion, Include } kind;
+    string_view file;           // empty when there is none (built-ins)
+    unsigned line;
+    unsigned column;
+    string_view name;           // macro name, or the #include's spelling
+    string_view definition;     // Define: raw source text
+    bool function_like;
+};
+
+// How a macro definition differs between two parses (--watch).
+enum class Change { Added, Removed, Changed };
+
+// Renders a file's report into a string, in one of the --format
+// encodings. Each worker has its own sink; the finished string goes to
+// the output in one piece, so nothing is written or flushed per event.
+class Sink {
+public:
+    virtual ~Sink() = default;
+    virtual void begin(string_view path) = 0;
+    virtual void event(const Event& e) = 0;
+    virtual void end(size_t macros) = 0;
+    virtual void error(string_view message) = 0;
+    virtual void summary(size_t files, size_t macros) = 0;
+    // definition is already normalized, and empty for Change::Removed.
+    virtual void change(Change kind, string_view location, string_view name,
+                        string_view definition) = 0;
+
+    // Hands over what has been rendered so far.
+    string take() {
+        string result;
+        result.swap(out);
+        return result;
+    }
+
+protected:
+    void number(uint64_t n) {
+        char buf[24];
+        out.append(buf, to_chars(buf, buf + sizeof(buf), n).ptr);
+    }
+
+    string out;
+    string text;    // scratch for normalizeSourceText
+};
+
+class TextSink : public Sink {
+public:
+    void begin(string_view path) override {
+        out += "=== Macro Analysis: ";
+        out += path;
+        out += " ===\n";
+    }
+
+    void event(const Event& e) override {
+        if (e.file.empty()) {
+            out += "<unknown>";
+        }
+        else {
+            out += e.file;
+            out += ':';
+            number(e.line);
+            out += ':';
+            number(e.column);
+        }
+        switch (e.kind) {
+        case Event::Define:
+            out += ": #define ";
+            out += e.name;
+            if (e.function_like) {
+                out += "(...) [function-like]";
+            }
+            out += "\n  Definition: ";
+            normalizeSourceText(e.definition, out);
+            break;
+        case Event::Expansion:
+            out += ": Macro expansion: ";
+            out += e.name;
+            break;
+        case Event::Include:
+            out += ": #include ";
+            out += e.name;
+            break;
+        }
+        out += '\n';
+    }
+
+    void end(size_t macros) override {
+        out += "\n=== Total: ";
+        number(macros);
+        out += " macro definitions ===\n";
+    }
+
+    void error(string_view message) override {
+        out += "Error: ";
+        out += message;
+        out += '\n';
+    }
+
+    void summary(size_t files, size_t macros) override {
+        out += "\n=== ";
+        number(files);
+        out += " files, ";
+        number(macros);
+        out += " macro definitions ===\n";
+    }
+
+    void change(Change kind, string_view location, string_view name,
+                string_view definition) override {
+        static const char* const marks[] = { "+ ", "- ", "~ " };
+        out += marks[int(kind)];
+        out += location;
+        out += ": #define ";
+        out += kind == Change::Removed ? name : definition;
+        out += '\n';
+    }
+};
+
+// --format=jsonl: one JSON object per line, "event" naming its kind.
+class JsonSink : public Sink {
+public:
+    void begin(string_view path) override {
+        out += "{\"event\":\"file\",\"path\":";
+        str(path);
+        out += "}\n";
+    }
+
+    void event(const Event& e) override {
+        static const char* const kinds[] = { "define", "expansion", "include" };
+        out += "{\"event\":\"";
+        out += kinds[e.kind];
+        out += "\",\"file\":";
+        str(e.file);
+        out += ",\"line\":";
+        number(e.line);
+        out += ",\"column\":";
+        number(e.column);
+        out += ",\"name\":";
+        str(e.name);
+        if (e.kind == Event::Define) {
+            out += ",\"function_like\":";
+            out += e.function_like ? "true" : "false";
+            out += ",\"definition\":";
+            text.clear();
+            normalizeSourceText(e.definition, text);
+            str(text);
+        }
+        out += "}\n";
+    }
+
+    void end(size_t macros) override {
+        out += "{\"event\":\"total\",\"macros\":";
+        number(macros);
+        out += "}\n";
+    }
+
+    void error(string_view message) override {
+        out += "{\"event\":\"error\",\"message\":";
+        str(message);
+        out += "}\n";
+    }
+
+    void summary(size_t files, size_t macros) override {
+        out += "{\"event\":\"summary\",\"files\":";
+        number(files);
+        out += ",\"macros\":";
+        number(macros);
+        out += "}\n";
+    }
+
+    void change(Change kind, string_view location, string_view name,
+                string_view definition) override {
+        static const char* const kinds[] = { "added", "removed", "changed" };
+        out += "{\"event\":\"change\",\"change\":\"";
+        out += kinds[int(kind)];
+        out += "\",\"location\":";
+        str(location);
+        out += ",\"name\":";
+        str(name);
+        if (kind != Change::Removed) {
+            out += ",\"definition\":";
+            str(definition);
+        }
+        out += "}\n";
+    }
+
+private:
+    void str(string_view s) {
+        out += '"';
+        for (unsigned char c : s) {
+            if (c == '"' || c == '\\') {
+                out += '\\';
+                out += c;
+            }
+            else if (c < 0x20) {
+                static const char hex[] = "0123456789abcdef";
+                out += "\\u00";
+                out += hex[c >> 4];
+                out += hex[c & 15];
+            }
+            else {
+                out += c;
+            }
+        }
+        out += '"';
+    }
+};
+
+// --format=bin: BinaryMagic, then one record per event: a kind byte and
+// its fields, integers as little-endian u32 (on any host) and strings as
+// a u32 length followed by the bytes. A record with a string too long for
+// its length field is replaced by an 'X' record.
+//
+//   'F' path                                   start of a file
+//   'D' file line column flags name definition flags bit 0: function-like
+//   'E' file line column name
+//   'I' file line column spelling
+//   'T' macros                                 end of a file
+//   'X' message                                error
+//   'S' files macros                           end of the run
+//   'C' change location name definition        --watch: change is 'A'dded,
+//                                              'R'emoved or 'C'hanged
+const char BinaryMagic[8] = { 'M', 'A', 'C', 'R', 'O', 'E', 'V', '1' };
+
+class BinarySink : public Sink {
+public:
+    void begin(string_view path) override {
+        size_t start = out.size();
+        out += 'F';
+        str(path);
+        dropIfTooLong(start);
+    }
+
+    void event(const Event& e) override {
+        static const char kinds[] = { 'D', 'E', 'I' };
+        size_t start = out.size();
+        out += kinds[e.kind];
+        str(e.file);
+        u32(e.line);
+        u32(e.column);
+        if (e.kind == Event::Define) {
+            u32(e.function_like ? 1 : 0);
+        }
+        str(e.name);
+        if (e.kind == Event::Define) {
+            text.clear();
+            normalizeSourceText(e.definition, text);
+            str(text);
+        }
+        dropIfTooLong(start);
+    }
+
+    void end(size_t macros) override {
+        out += 'T';
+        u32(macros);
+    }
+
+    void error(string_view message) override {
+        out += 'X';
+        str(message.substr(0, UINT32_MAX));
+    }
+
+    void summary(size_t files, size_t macros) override {
+        out += 'S';
+        u32(files);
+        u32(macros);
+    }
+
+    void change(Change kind, string_view location, string_view name,
+                string_view definition) override {
+        static const char kinds[] = { 'A', 'R', 'C' };
+        size_t start = out.size();
+        out += 'C';
+        out += kinds[int(kind)];
+        str(location);
+        str(name);
+        str(definition);
+        dropIfTooLong(start);
+    }
+
+private:
+    void u32(uint32_t v) {
+        for (int shift = 0; shift < 32; shift += 8) {
+            out += char(v >> shift);
+        }
+    }
+
+    void str(string_view s) {
+        if (s.size() > UINT32_MAX) {
+            tooLong = true;
+            return;
+        }
+        u32(uint32_t(s.size()));
+        out += s;
+    }
+
+    // Takes back the record that started at start if str() refused one
+    // of its strings.
+    void dropIfTooLong(size_t start) {
+        if (!tooLong) {
+            return;
+        }
+        tooLong = false;
+        out.resize(start);
+        error("record dropped: a string in it is longer than 4 GiB");
+    }
+
+    bool tooLong = false;
+};
+
+enum class Format { Text, Json, Binary };
+
+unique_ptr<Sink> makeSink(Format format) {
+    switch (format) {
+    case Format::Json:
+        return make_unique<JsonSink>();
+    case Format::Binary:
+        return make_unique<BinarySink>();
+    default:
+        return make_unique<TextSink>();
+    }
+}
+
+bool writeAll(int fd, string_view s) {
+    while (!s.empty()) {
+        ssize_t n = ::write(fd, s.data(), s.size());
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        s.remove_prefix(n);
+    }
+    return true;
+}
+
+// Copies a source file to out unchanged (the null transformer) without
+// reading it into this process: sendfile(2) moves the file's pages
+// straight to the output. Outputs sendfile refuses (EINVAL, e.g. a file
+// opened with O_APPEND) get the rest of the file mapped and written with
+// a single write(2).
+bool passThrough(const string& path, int out) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    bool ok = fstat(fd, &st) == 0;
+    off_t offset = 0;
+    while (ok && offset < st.st_size) {
+        ssize_t n = sendfile(out, fd, &offset, st.st_size - offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+            void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            ok = map != MAP_FAILED &&
+                 writeAll(out, string_view(static_cast<const char*>(map) + offset, st.st_size - offset));
+            if (map != MAP_FAILED) {
+                munmap(map, st.st_size);
+            }
+            break;
+        }
+        if (n <= 0) {
+            ok = false;
+        }
+    }
+    close(fd);
+    return ok;
+}
+
+// Large write buffer over a file descriptor. Reports are appended whole
+// and go out with write(2) a megabyte at a time.
+class OutputBuffer {
+public:
+    explicit OutputBuffer(int fd) : fd(fd) {
+        buf.reserve(limit);
+    }
+
+    ~OutputBuffer() {
+        flush();
+    }
+
+    void append(string_view s) {
+        if (buf.size() + s.size() > limit) {
+            flush();
+            if (s.size() >= limit) {
+                failed |= !writeAll(fd, s);
+                return;
+            }
+        }
+        buf += s;
+    }
+
+    // False once any write has failed.
+    bool flush() {
+        failed |= !writeAll(fd, buf);
+        buf.clear();
+        return !failed;
+    }
+
+private:
+    static const size_t limit = 1 << 20;
+    int fd;
+    string buf;
+    bool failed = false;
+};
+
 struct MacroInfo {
     string name;
-    string location;
-    string definition;
+    string_view definition;     // raw source text, see getSourceText
     bool is_function_like;
+    CXFile file;
+    unsigned line;
+    unsigned column;
+};
+
+// An expansion site, kept only for --db.
+struct MacroUse {
+    string name;
+    CXFile file;
+    unsigned line;
+    unsigned column;
 };
 
 struct VisitorData {
@@ -70,27 +574,48 @@ struct VisitorData {
     string main_filename;
     vector<MacroInfo> macros;
     bool verbose;
+    bool quiet;     // collect only, print nothing (--watch reparses)
+    Sink* sink;     // this file's report
+    bool record = false;        // collect expansions (--db)
+    vector<MacroUse> expansions;
+    map<CXFile, string> file_names;
 };
-ostream &operator << (ostream &lhs, MacroInfo rhs) {
-  return lhs << "MacroInfo{ }" << endl;
-};
-// Visitor callback
+
+// File names are looked up once per file, not once per event.
+const string& fileName(VisitorData& data, CXFile file) {
+    auto it = data.file_names.find(file);
+    if (it == data.file_names.end()) {
+        it = data.file_names.emplace(file, file ? fromCXString(clang_getFileName(file)) : string()).first;
+    }
+    return it->second;
+}
+
+// Visitor callback, over the TU cursor's children only. clang_visitChildren
+// hands out the preprocessing record (definitions, expansions, inclusions,
+// none of which have children) before any declaration, so the first
+// declaration ends the walk: the AST itself is never visited.
 CXChildVisitResult visitor(CXCursor cursor, CXCursor parent, CXClientData client_data) {
     VisitorData* data = static_cast<VisitorData*>(client_data);
     
+    CXCursorKind kind = clang_getCursorKind(cursor);
+    if (!clang_isPreprocessing(kind)) {
+        return CXChildVisit_Break;
+    }
+    
     CXSourceLocation location = clang_getCursorLocation(cursor);
+    bool report = data->verbose && !data->quiet;
     
+    Event e;
     CXFile file;
-    clang_getFileLocation(location, &file, nullptr, nullptr, nullptr);
-//       if (!file) return CXChildVisit_Continue;
+    clang_getFileLocation(location, &file, &e.line, &e.column, nullptr);
+    e.function_like = false;
     
-//       string filename = fromCXString(clang_getFileName(file));
-    
-    CXCursorKind kind = clang_getCursorKind(cursor);
     if (kind == CXCursor_MacroDefinition) {
         MacroInfo info;
         info.name = fromCXString(clang_getCursorSpelling(cursor));
-        info.location = getLocation(location);
+        info.file = file;
+        info.line = e.line;
+        info.column = e.column;
         
         // Get the macro definition
         CXSourceRange extent = clang_getCursorExtent(cursor);
@@ -99,45 +624,568 @@ CXChildVisitResult visitor(CXCursor cursor, CXCursor parent, CXClientData client
         info.is_function_like = clang_Cursor_isMacroFunctionLike(cursor);
         
         data->macros.push_back(info);
-        
-        cerr << info.location << ": #define " << info.name;
-        cerr << info << endl;
-        if (info.is_function_like) {
-            cerr << "(...) [function-like]";
-        }
-        cerr << "\n";
-        if (data->verbose) {
-            cerr << "  Definition: " << info.definition << "\n";
+        if (data->quiet) {
+            return CXChildVisit_Continue;
         }
+        
+        e.kind = Event::Define;
+        e.file = fileName(*data, file);
+        e.name = data->macros.back().name;
+        e.definition = info.definition;
+        e.function_like = info.is_function_like;
+        data->sink->event(e);
     }
     else if (kind == CXCursor_MacroExpansion) {
-        if (data->verbose) {
-            string name = fromCXString(clang_getCursorSpelling(cursor));
-            string loc = getLocation(location);
-            cerr << loc << ": Macro expansion: " << name << "\n";
+        if (!data->record && !report) {
+            return CXChildVisit_Continue;
+        }
+        string name = fromCXString(clang_getCursorSpelling(cursor));
+        if (report) {
+            e.kind = Event::Expansion;
+            e.file = fileName(*data, file);
+            e.name = name;
+            data->sink->event(e);
+        }
+        if (data->record) {
+            data->expansions.push_back(MacroUse{ std::move(name), file, e.line, e.column });
         }
     }
     else if (kind == CXCursor_InclusionDirective) {
-        if (data->verbose) {
+        if (report) {
             string included = fromCXString(clang_getCursorDisplayName(cursor));
-            string loc = getLocation(location);
-            cerr << loc << ": #include " << included << "\n";
+            e.kind = Event::Include;
+            e.file = fileName(*data, file);
+            e.name = included;
+            data->sink->event(e);
         }
     }
     
-    return CXChildVisit_Recurse;
+    return CXChildVisit_Continue;
+}
+
+// A definition as kept between two parses. The text is copied out here:
+// the buffers MacroInfo points into go away with the TU they came from.
+struct MacroSnapshot {
+    string location;
+    string definition;
+};
+
+// Macro definitions by name, as they stand at the end of the TU (the last
+// #define of a name wins).
+typedef map<string, MacroSnapshot> MacroTable;
+
+MacroTable macroTable(vector<MacroInfo>& macros) {
+    MacroTable table;
+    for (MacroInfo& info : macros) {
+        MacroSnapshot& snapshot = table[info.name];
+        snapshot.location = getLocation(info.file, info.line, info.column);
+        snapshot.definition.clear();
+        normalizeSourceText(info.definition, snapshot.definition);
+    }
+    return table;
+}
+
+// Reports the definitions that differ between two tables through sink;
+// returns how many. A macro that only moved (same text, new line) is not
+// a change.
+unsigned printMacroDiff(const MacroTable& before, const MacroTable& after, Sink& sink) {
+    unsigned changes = 0;
+    auto b = before.begin();
+    auto a = after.begin();
+    while (b != before.end() || a != after.end()) {
+        if (a == after.end() || (b != before.end() && b->first < a->first)) {
+            sink.change(Change::Removed, b->second.location, b->first, string_view());
+            ++changes;
+            ++b;
+        }
+        else if (b == before.end() || a->first < b->first) {
+            sink.change(Change::Added, a->second.location, a->first, a->second.definition);
+            ++changes;
+            ++a;
+        }
+        else {
+            if (a->second.definition != b->second.definition) {
+                sink.change(Change::Changed, a->second.location, a->first, a->second.definition);
+                ++changes;
+            }
+            ++a;
+            ++b;
+        }
+    }
+    return changes;
+}
+
+// inotify watches for --watch. The directories holding the TU's files are
+// watched rather than the files themselves: editors often save by writing
+// a new file and renaming it over the old one, which a watch on the old
+// inode never reports.
+class Watcher {
+public:
+    ~Watcher() {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    bool open() {
+        fd = inotify_init1(IN_CLOEXEC);
+        return fd >= 0;
+    }
+
+    // (Re)reads the TU's inclusions; a reparse may have added or dropped
+    // some.
+    void watch(CXTranslationUnit tu) {
+        files.clear();
+        clang_getInclusions(tu, addInclusion, this);
+        for (const string& file : files) {
+            string dir = file.substr(0, file.rfind('/'));
+            if (watched.count(dir)) {
+                continue;
+            }
+            int wd = inotify_add_watch(fd, dir.c_str(),
+                IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE);
+            if (wd >= 0) {
+                dirs[wd] = dir;
+                watched.insert(dir);
+            }
+        }
+    }
+
+    size_t size() const { return files.size(); }
+
+    // Blocks until one of the TU's files changes, then waits for the burst
+    // of events a save makes to settle. Sets changed to the first file.
+    bool wait(string& changed) {
+        changed.clear();
+        int timeout = -1;
+        for (;;) {
+            pollfd p = { fd, POLLIN, 0 };
+            int n = poll(&p, 1, timeout);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0) {
+                return false;
+            }
+            if (n == 0) {
+                return true;
+            }
+            alignas(inotify_event) char buf[4096];
+            ssize_t len = read(fd, buf, sizeof(buf));
+            if (len <= 0) {
+                return false;
+            }
+            for (char* ptr = buf; ptr < buf + len; ) {
+                const inotify_event* ev = reinterpret_cast<const inotify_event*>(ptr);
+                ptr += sizeof(inotify_event) + ev->len;
+                auto dir = dirs.find(ev->wd);
+                if (!ev->len || dir == dirs.end()) {
+                    continue;
+                }
+                string path = dir->second + "/" + ev->name;
+                if (files.count(path) && changed.empty()) {
+                    changed = path;
+                    timeout = 10;
+                }
+            }
+        }
+    }
+
+private:
+    static void addInclusion(CXFile file, CXSourceLocation*, unsigned, CXClientData client_data) {
+        Watcher* self = static_cast<Watcher*>(client_data);
+        string name = fromCXString(clang_getFileName(file));
+        if (char* real = realpath(name.c_str(), nullptr)) {
+            self->files.insert(real);
+            free(real);
+        }
+    }
+
+    int fd = -1;
+    map<int, string> dirs;      // watch descriptor -> directory
+    set<string> watched;
+    set<string> files;          // real paths of the TU's files
+};
+
+// One input file and the arguments to parse it with.
+struct Job {
+    string filename;
+    vector<string> args;
+    string directory;   // file names clang reports are relative to this
+};
+
+CXTranslationUnit parseJob(CXIndex index, const Job& job, unsigned options) {
+    vector<const char*> args;
+    for (const string& arg : job.args) {
+        args.push_back(arg.c_str());
+    }
+    return clang_parseTranslationUnit(index, job.filename.c_str(), args.data(), args.size(),
+                                      nullptr, 0, options);
+}
+
+// Parses one file and renders its report through data.sink. The TU is
+// left in data.tu, for the caller to dispose of or keep.
+bool analyzeFile(CXIndex index, const Job& job, unsigned options, VisitorData& data) {
+    data.tu = parseJob(index, job, options);
+    if (!data.tu) {
+        data.sink->error("Failed to parse " + job.filename);
+        return false;
+    }
+    
+    // Get main file
+    CXFile mainFile = clang_getFile(data.tu, job.filename.c_str());
+    data.main_filename = fromCXString(clang_getFileName(mainFile));
+    
+    data.sink->begin(job.filename);
+    
+    // Walk the preprocessing record to find macros
+    CXCursor cursor = clang_getTranslationUnitCursor(data.tu);
+    clang_visitChildren(cursor, visitor, &data);
+    
+    data.sink->end(data.macros.size());
+    return true;
+}
+
+// True when a report on fd shows up in the same stream as stdout: it is
+// stderr (a terminal, or redirected with 2>&1) or the same file.
+bool sharesStdout(int fd) {
+    if (fd == 2) {
+        return true;
+    }
+    struct stat a, b;
+    return fstat(fd, &a) == 0 && fstat(1, &b) == 0 &&
+           a.st_dev == b.st_dev && a.st_ino == b.st_ino;
+}
+
+// Writes each file's report to the report buffer and its source to
+// stdout, in input order. Workers finish out of order, so a file that is
+// done early waits until every file before it has been written. When the
+// report shares a stream with stdout, it is flushed before each source so
+// that the two come out in order.
+class OrderedOutput {
+public:
+    OrderedOutput(const vector<Job>& jobs, int fd, Format format)
+        : jobs(jobs), results(jobs.size()), out(fd), sink(makeSink(format)),
+          interleaved(sharesStdout(fd)) {
+        if (format == Format::Binary) {
+            out.append(string_view(BinaryMagic, sizeof(BinaryMagic)));
+        }
+    }
+
+    void done(size_t i, string report, size_t macros, bool ok) {
+        lock_guard<mutex> guard(lock);
+        results[i] = Result{ std::move(report), macros, ok, true };
+        for (; next < results.size() && results[next].done; next++) {
+            write(next);
+        }
+    }
+
+    // Adds to the report after the files (--watch) and writes it out now.
+    bool append(string_view report) {
+        lock_guard<mutex> guard(lock);
+        out.append(report);
+        return flush();
+    }
+
+    // Ends the report with run-wide totals.
+    void summary() {
+        sink->summary(jobs.size(), totalMacros);
+        out.append(sink->take());
+    }
+
+    bool flush() {
+        if (!out.flush()) {
+            anyFailed = true;
+        }
+        return !anyFailed;
+    }
+
+    bool failed() const { return anyFailed; }
+
+private:
+    struct Result {
+        string report;
+        size_t macros;
+        bool ok;
+        bool done;
+    };
+
+    void write(size_t i) {
+        Result& r = results[i];
+        out.append(r.report);
+        r.report = string();
+        totalMacros += r.macros;
+        if (!r.ok) {
+            anyFailed = true;
+            return;
+        }
+        if (interleaved && !out.flush()) {
+            anyFailed = true;
+        }
+        // Output original source to stdout (null transformer)
+        if (!passThrough(jobs[i].filename, 1)) {
+            sink->error("Could not copy source file " + jobs[i].filename + " to stdout");
+            out.append(sink->take());
+            anyFailed = true;
+        }
+    }
+
+    const vector<Job>& jobs;
+    vector<Result> results;
+    mutex lock;
+    size_t next = 0;
+    size_t totalMacros = 0;
+    bool anyFailed = false;
+    OutputBuffer out;
+    unique_ptr<Sink> sink;  // for the output's own records
+    bool interleaved;       // report and stdout share a stream
+};
+
+// --watch: reparses the TU on every change and reports the macro
+// definitions that differ from the previous parse. The TU was parsed with
+// a precompiled preamble, so an edit below the #includes only reparses
+// the main file. Changes go through sink to the report, in --format;
+// progress lines go to stderr.
+int watchTranslationUnit(CXIndex index, CXTranslationUnit& tu, const Job& job,
+                         unsigned options, vector<MacroInfo>& macros,
+                         Sink& sink, OrderedOutput& output) {
+    Watcher watcher;
+    if (!watcher.open()) {
+        cerr << "Error: inotify: " << strerror(errno) << "\n";
+        return 1;
+    }
+    MacroTable table = macroTable(macros);
+    watcher.watch(tu);
+    cerr << "=== Watching " << watcher.size() << " files ===\n";
+
+    string changed;
+    while (watcher.wait(changed)) {
+        auto start = chrono::steady_clock::now();
+        // A failed reparse leaves the TU unusable; start over.
+        if (tu && clang_reparseTranslationUnit(tu, 0, nullptr, clang_defaultReparseOptions(tu)) != 0) {
+            clang_disposeTranslationUnit(tu);
+            tu = nullptr;
+        }
+        if (!tu) {
+            tu = parseJob(index, job, options);
+        }
+        if (!tu) {
+            cerr << "Error: Failed to parse " << job.filename << "\n";
+            continue;
+        }
+
+        VisitorData data;
+        data.tu = tu;
+        data.verbose = false;
+        data.quiet = true;
+        data.sink = nullptr;
+        clang_visitChildren(clang_getTranslationUnitCursor(tu), visitor, &data);
+        MacroTable now = macroTable(data.macros);
+        unsigned changes = printMacroDiff(table, now, sink);
+        table.swap(now);
+        if (!output.append(sink.take())) {
+            cerr << "Error: Cannot write report: " << strerror(errno) << "\n";
+            return 1;
+        }
+        watcher.watch(tu);
+
+        double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        cerr << "=== " << changed << ": " << changes << " macro changes, reparsed in "
+             << ms << " ms ===\n";
+    }
+    cerr << "Error: inotify: " << strerror(errno) << "\n";
+    return 1;
+}
+
+// Jobs from the compilation database in dir: one per file named, or per
+// file in the database when none are. Each gets the file's own command
+// line, without the compiler, the input and the output, run from the
+// command's directory; files the database does not know get just the
+// default arguments.
+bool loadCompileCommands(const char* dir, const vector<const char*>& files,
+                         const vector<string>& defaults, const vector<string>& extra,
+                         vector<Job>& jobs) {
+    CXCompilationDatabase_Error error;
+    CXCompilationDatabase db = clang_CompilationDatabase_fromDirectory(dir, &error);
+    if (error != CXCompilationDatabase_NoError) {
+        cerr << "Error: Cannot load " << dir << "/compile_commands.json\n";
+        return false;
+    }
+    
+    set<string> seen;
+    auto addCommands = [&](CXCompileCommands commands, const string& fallback) {
+        unsigned count = commands ? clang_CompileCommands_getSize(commands) : 0;
+        if (count == 0 && !fallback.empty()) {
+            cerr << "Warning: No compile command for " << fallback << ", using defaults\n";
+            jobs.push_back(Job{ fallback, defaults });
+            jobs.back().args.insert(jobs.back().args.end(), extra.begin(), extra.end());
+        }
+        for (unsigned i = 0; i < count; i++) {
+            CXCompileCommand command = clang_CompileCommands_getCommand(commands, i);
+            string directory = fromCXString(clang_CompileCommand_getDirectory(command));
+            string source = fromCXString(clang_CompileCommand_getFilename(command));
+            Job job;
+            job.filename = source[0] == '/' ? source : directory + "/" + source;
+            if (!seen.insert(job.filename).second) {
+                continue;
+            }
+            job.args = defaults;
+            job.args.push_back("-working-directory=" + directory);
+            job.directory = directory;
+            unsigned argc = clang_CompileCommand_getNumArgs(command);
+            for (unsigned a = 1; a < argc; a++) {
+                string arg = fromCXString(clang_CompileCommand_getArg(command, a));
+                // Dependency-file flags would have libclang write (over)
+                // the build's .d files.
+                if (arg == "-o" || arg == "-MF" || arg == "-MT" || arg == "-MQ" || arg == "-MJ") {
+                    a++;
+                }
+                else if (arg.compare(0, 2, "-M") == 0 || arg.compare(0, 8, "-Wp,-MD,") == 0 ||
+                         arg.compare(0, 9, "-Wp,-MMD,") == 0) {
+                    continue;
+                }
+                else if (arg != "-c" && arg != source && arg != job.filename) {
+                    job.args.push_back(std::move(arg));
+                }
+            }
+            job.args.insert(job.args.end(), extra.begin(), extra.end());
+            jobs.push_back(std::move(job));
+        }
+        if (commands) {
+            clang_CompileCommands_dispose(commands);
+        }
+    };
+    
+    if (files.empty()) {
+        addCommands(clang_CompilationDatabase_getAllCompileCommands(db), string());
+    }
+    for (const char* file : files) {
+        char* real = realpath(file, nullptr);
+        string path = real ? real : file;
+        free(real);
+        addCommands(clang_CompilationDatabase_getCompileCommands(db, path.c_str()), path);
+    }
+    clang_CompilationDatabase_dispose(db);
+    return true;
+}
+
+// A file name as clang spells it, made absolute against the compile
+// command's directory and normalized, so that one header gets one name in
+// the database whichever TU or directory it was reached from.
+string absolutePath(const string& directory, const string& name) {
+    if (name.empty()) {
+        return name;
+    }
+    string path = name[0] == '/' || directory.empty() ? name : directory + "/" + name;
+    if (char* real = realpath(path.c_str(), nullptr)) {
+        path = real;
+        free(real);
+        return path;
+    }
+    return filesystem::absolute(path).lexically_normal().string();
+}
+
+// Adds one TU's definitions and expansion sites to the database. Must run
+// before the TU is disposed of: the definitions' text lives in its buffers.
+// Bodies are normalized and paths resolved before taking db_lock, so
+// workers only wait on each other for the inserts.
+void addToDatabase(macrodb::Writer& db, mutex& db_lock, VisitorData& data, const Job& job) {
+    vector<string> bodies(data.macros.size());
+    for (size_t i = 0; i < data.macros.size(); i++) {
+        normalizeSourceText(data.macros[i].definition, bodies[i]);
+    }
+    map<CXFile, string> paths;
+    auto path = [&](CXFile file) -> const string& {
+        auto it = paths.find(file);
+        if (it == paths.end()) {
+            it = paths.emplace(file, absolutePath(job.directory, fileName(data, file))).first;
+        }
+        return it->second;
+    };
+    for (const MacroInfo& info : data.macros) {
+        path(info.file);
+    }
+    for (const MacroUse& use : data.expansions) {
+        path(use.file);
+    }
+    lock_guard<mutex> guard(db_lock);
+    for (size_t i = 0; i < data.macros.size(); i++) {
+        const MacroInfo& info = data.macros[i];
+        db.addDefinition(info.name, paths[info.file], info.line, info.column,
+                         bodies[i], info.is_function_like);
+    }
+    for (const MacroUse& use : data.expansions) {
+        db.addExpansion(use.name, paths[use.file], use.line, use.column);
+    }
+}
+
+string dbLocation(const macrodb::Reader& db, uint32_t file, uint32_t line, uint32_t column) {
+    string_view name = db.str(file);
+    if (name.empty()) {
+        return "<built-in>";
+    }
+    return string(name) + ":" + to_string(line) + ":" + to_string(column);
+}
+
+// --expanded NAME: every place NAME is expanded, one per line.
+void printExpansions(const macrodb::Reader& db, const char* name) {
+    db.expansions(name, [&](const macrodb::Expansion& e) {
+        cout << dbLocation(db, e.file, e.line, e.column) << "\n";
+    });
+}
+
+// --conflicts NAME: the definitions of NAME grouped by body, and whether
+// more than one body exists.
+void printConflicts(const macrodb::Reader& db, const char* name) {
+    vector<const macrodb::Definition*> defs;
+    db.definitions(name, [&](const macrodb::Definition& d) { defs.push_back(&d); });
+    stable_sort(defs.begin(), defs.end(), [](const macrodb::Definition* a, const macrodb::Definition* b) {
+        return a->body_hash < b->body_hash;
+    });
+    size_t bodies = 0;
+    for (size_t i = 0; i < defs.size(); i++) {
+        if (i == 0 || defs[i]->body_hash != defs[i - 1]->body_hash) {
+            bodies++;
+        }
+    }
+    if (bodies < 2) {
+        cout << name << ": no conflicting definitions (" << defs.size() << " found)\n";
+        return;
+    }
+    cout << name << ": " << bodies << " different definitions\n";
+    for (size_t i = 0; i < defs.size(); i++) {
+        if (i == 0 || defs[i]->body_hash != defs[i - 1]->body_hash) {
+            cout << "  #define " << db.str(defs[i]->body) << "\n";
+        }
+        cout << "    " << dbLocation(db, defs[i]->file, defs[i]->line, defs[i]->column) << "\n";
+    }
 }
 
 void printUsage(const char* prog) {
-    cerr << "Usage: " << prog << " <file> [options] [-- clang-args...]\n";
+    cerr << "Usage: " << prog << " <file>... [options] [-- clang-args...]\n";
     cerr << "Options:\n";
     cerr << "  -v, --verbose  Show macro expansions and includes\n";
+    cerr << "  -p <dir>       Take compile commands from <dir>/compile_commands.json;\n";
+    cerr << "                 with no files given, analyze every file in it\n";
+    cerr << "  -j <n>         Parse <n> files at a time (default: one per core)\n";
+    cerr << "  --format=<f>   Report as text (default), jsonl or bin\n";
+    cerr << "  -o <file>      Write the report to <file> instead of stderr\n";
+    cerr << "  --db <file>    Write every definition and expansion site to a macro\n";
+    cerr << "                 database; with the options below, query it instead\n";
+    cerr << "  --expanded <name>   Where <name> is expanded (needs --db)\n";
+    cerr << "  --conflicts <name>  Differing definitions of <name> (needs --db)\n";
+    cerr << "  --watch        Keep running: reparse on every change to the file or its\n";
+    cerr << "                 includes and report added/removed/changed macros\n";
     cerr << "  -h, --help     Show this help\n";
-    cerr << "\nReports preprocessor constructs to stderr.\n";
-    cerr << "Outputs unchanged source to stdout.\n";
+    cerr << "\nReports preprocessor constructs to stderr (or -o).\n";
+    cerr << "Outputs unchanged source to stdout, file after file.\n";
     cerr << "\nExamples:\n";
     cerr << "  " << prog << " source.c 2>macros.log > output.c\n";
     cerr << "  " << prog << " source.c -v -- -I./include\n";
+    cerr << "  " << prog << " -p build -j 8 2>macros.log >/dev/null\n";
+    cerr << "  " << prog << " -p build --format=jsonl -o macros.jsonl >/dev/null\n";
+    cerr << "  " << prog << " -p build --db macros.db >/dev/null 2>&1\n";
+    cerr << "  " << prog << " --db macros.db --conflicts NDEBUG\n";
 }
 
 int main(int argc, const char* argv[]) {
@@ -147,9 +1195,17 @@ int main(int argc, const char* argv[]) {
     }
     
     // Parse arguments
-    const char* filename = nullptr;
+    vector<const char*> files;
+    const char* build_dir = nullptr;
+    const char* db_path = nullptr;
+    vector<const char*> expanded;
+    vector<const char*> conflicts;
+    const char* report_path = nullptr;
+    Format format = Format::Text;
+    unsigned workers = 0;
     bool verbose = false;
-    vector<const char*> clang_args;
+    bool watch = false;
+    vector<string> clang_args;
     
     bool in_clang_args = false;
     for (int i = 1; i < argc; i++) {
@@ -162,12 +1218,42 @@ int main(int argc, const char* argv[]) {
         else if (strcmp(argv[i], "-v") == 0 || strcmp(argv[i], "--verbose") == 0) {
             verbose = true;
         }
+        else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+            build_dir = argv[++i];
+        }
+        else if (strcmp(argv[i], "--db") == 0 && i + 1 < argc) {
+            db_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--expanded") == 0 && i + 1 < argc) {
+            expanded.push_back(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--conflicts") == 0 && i + 1 < argc) {
+            conflicts.push_back(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            workers = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            report_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--format=text") == 0) {
+            format = Format::Text;
+        }
+        else if (strcmp(argv[i], "--format=jsonl") == 0) {
+            format = Format::Json;
+        }
+        else if (strcmp(argv[i], "--format=bin") == 0) {
+            format = Format::Binary;
+        }
+        else if (strcmp(argv[i], "--watch") == 0) {
+            watch = true;
+        }
         else if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
             printUsage(argv[0]);
             return 0;
         }
-        else if (!filename) {
-            filename = argv[i];
+        else if (argv[i][0] != '-') {
+            files.push_back(argv[i]);
         }
         else {
             cerr << "Error: Unknown argument: " << argv[i] << "\n";
@@ -176,72 +1262,160 @@ int main(int argc, const char* argv[]) {
         }
     }
     
-    if (!filename) {
+    // Queries read the database and parse nothing
+    if (!expanded.empty() || !conflicts.empty()) {
+        if (!db_path) {
+            cerr << "Error: --expanded and --conflicts need --db\n";
+            return 1;
+        }
+        macrodb::Reader db;
+        string error;
+        if (!db.open(db_path, error)) {
+            cerr << "Error: " << error << "\n";
+            return 1;
+        }
+        for (const char* name : expanded) {
+            printExpansions(db, name);
+        }
+        for (const char* name : conflicts) {
+            printConflicts(db, name);
+        }
+        return 0;
+    }
+    
+    if (files.empty() && !build_dir) {
         cerr << "Error: No input file specified\n";
         printUsage(argv[0]);
         return 1;
     }
     
     // Add default clang args
-    vector<const char*> all_args = {
+    vector<string> default_args = {
         "-fsyntax-only",
         "-ferror-limit=0",
         "-Wno-everything"
     };
-    all_args.insert(all_args.end(), clang_args.begin(), clang_args.end());
+    vector<Job> jobs;
+    if (build_dir) {
+        if (!loadCompileCommands(build_dir, files, default_args, clang_args, jobs)) {
+            return 1;
+        }
+    }
+    else {
+        for (const char* file : files) {
+            jobs.push_back(Job{ file, default_args });
+            jobs.back().args.insert(jobs.back().args.end(), clang_args.begin(), clang_args.end());
+        }
+    }
+    if (jobs.empty()) {
+        cerr << "Error: No input files in " << build_dir << "/compile_commands.json\n";
+        return 1;
+    }
+    if (watch && jobs.size() != 1) {
+        cerr << "Error: --watch takes exactly one file\n";
+        return 1;
+    }
+    if (watch && db_path) {
+        cerr << "Error: --watch does not write a database\n";
+        return 1;
+    }
+    if (format == Format::Binary && !report_path) {
+        cerr << "Error: --format=bin needs -o\n";
+        return 1;
+    }
     
-    // Create index
+    int report_fd = 2;
+    if (report_path) {
+        report_fd = open(report_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+        if (report_fd < 0) {
+            cerr << "Error: Cannot open " << report_path << ": " << strerror(errno) << "\n";
+            return 1;
+        }
+    }
+    
+    // One index for all workers; each TU belongs to the worker that parsed
+    // it. libclang's own parser threads run at background priority.
     CXIndex index = clang_createIndex(0, 0);
+    clang_CXIndex_setGlobalOptions(index, CXGlobalOpt_ThreadBackgroundPriorityForAll);
     
-    // Parse with detailed preprocessing record
-    CXTranslationUnit tu = clang_parseTranslationUnit(
-        index,
-        filename,
-        all_args.data(),
-        all_args.size(),
-        nullptr,
-        0,
-        CXTranslationUnit_DetailedPreprocessingRecord |
-        CXTranslationUnit_SkipFunctionBodies
-    );
-    
-    if (!tu) {
-        cerr << "Error: Failed to parse " << filename << "\n";
-        clang_disposeIndex(index);
-        return 1;
+    // Parse with detailed preprocessing record. When watching, also keep a
+    // precompiled preamble so reparses skip the unchanged #includes.
+    unsigned options = CXTranslationUnit_DetailedPreprocessingRecord |
+                       CXTranslationUnit_SkipFunctionBodies;
+    if (watch) {
+        options |= CXTranslationUnit_PrecompiledPreamble;
     }
     
-    // Get main file
-    CXFile mainFile = clang_getFile(tu, filename);
-    string mainFilename = fromCXString(clang_getFileName(mainFile));
-    
-    // Visit AST to find macros
-    VisitorData data;
-    data.tu = tu;
-    data.main_filename = mainFilename;
-    data.verbose = true;
+    OrderedOutput output(jobs, report_fd, format);
     
-    cerr << "=== Macro Analysis: " << filename << " ===\n";
+    if (watch) {
+        unique_ptr<Sink> sink = makeSink(format);
+        VisitorData data;
+        data.verbose = true;
+        data.quiet = false;
+        data.sink = sink.get();
+        bool ok = analyzeFile(index, jobs[0], options, data);
+        output.done(0, sink->take(), data.macros.size(), ok);
+        int status = 1;
+        if (ok && output.flush()) {
+            status = watchTranslationUnit(index, data.tu, jobs[0], options, data.macros,
+                                          *sink, output);
+        }
+        if (data.tu) {
+            clang_disposeTranslationUnit(data.tu);
+        }
+        clang_disposeIndex(index);
+        return status;
+    }
     
-    CXCursor cursor = clang_getTranslationUnitCursor(tu);
-    clang_visitChildren(cursor, visitor, &data);
+    if (workers == 0) {
+        workers = max(1u, thread::hardware_concurrency());
+    }
+    workers = min<size_t>(workers, jobs.size());
     
-    cerr << "\n=== Total: " << data.macros.size() << " macro definitions ===\n";
+    macrodb::Writer db;
+    mutex db_lock;
+    atomic<size_t> next(0);
+    auto work = [&]() {
+        unique_ptr<Sink> sink = makeSink(format);
+        for (size_t i; (i = next++) < jobs.size(); ) {
+            VisitorData data;
+            data.verbose = true;
+            data.quiet = false;
+            data.sink = sink.get();
+            data.record = db_path != nullptr;
+            bool ok = analyzeFile(index, jobs[i], options, data);
+            if (ok && db_path) {
+                addToDatabase(db, db_lock, data, jobs[i]);
+            }
+            if (data.tu) {
+                clang_disposeTranslationUnit(data.tu);
+            }
+            output.done(i, sink->take(), data.macros.size(), ok);
+        }
+    };
+    vector<thread> threads;
+    for (unsigned w = 1; w < workers; w++) {
+        threads.emplace_back(work);
+    }
+    work();
+    for (thread& t : threads) {
+        t.join();
+    }
     
-    // Output original source to stdout (null transformer)
-    ifstream in(filename);
-    if (!in) {
-        cerr << "Error: Could not read source file\n";
-        clang_disposeTranslationUnit(tu);
-        clang_disposeIndex(index);
-        return 1;
+    if (jobs.size() > 1) {
+        output.summary();
     }
     
-    cout << in.rdbuf();
+    int status = output.flush() ? 0 : 1;
+    string error;
+    if (db_path && !db.write(db_path, error)) {
+        cerr << "Error: " << error << "\n";
+        status = 1;
+    }
     
     // Cleanup
-    clang_disposeTranslationUnit(tu);
     clang_disposeIndex(index);
     
-    return 0;
+    return status;
 }
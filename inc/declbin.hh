@@ -0,0 +1,165 @@
+#pragma once
+//
+// On-disk layout of `decls --format=bin` output, and a reader that mmaps
+// the file and answers queries in place, without deserializing anything.
+//
+// Layout (little-endian, offsets from the start of the file):
+//
+//   Header        fixed 64 bytes, see below
+//   Record[n]     fixed-width, at records_offset
+//   string table  NUL-terminated strings, at strtab_offset; every string
+//                 field of a Record is a byte offset into this table
+//   name index    optional open-addressing table of hash_buckets uint32_t
+//                 slots at hash_offset; a slot holds record index + 1 (0 is
+//                 empty), probed linearly from hashName(name) & (buckets-1)
+//
+// The reader assumes a little-endian host, as does everything else here.
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace declbin {
+
+constexpr char Magic[8] = {'D', 'E', 'C', 'L', 'B', 'I', 'N', '1'};
+constexpr uint32_t Version = 1;
+
+struct Header {
+  char magic[8];
+  uint32_t version;
+  uint32_t record_size;
+  uint64_t num_records;
+  uint64_t records_offset;
+  uint64_t strtab_offset;
+  uint64_t strtab_size;
+  uint64_t hash_offset;   // 0 when there is no name index
+  uint64_t hash_buckets;  // power of two
+};
+static_assert(sizeof(Header) == 64, "Header layout changed");
+
+struct Record {
+  uint32_t kind;          // string table offsets
+  uint32_t name;
+  uint32_t declaration;
+  uint32_t file;
+  uint32_t line;
+  uint32_t column;
+  uint8_t is_definition;
+  uint8_t reserved[3];
+};
+static_assert(sizeof(Record) == 28, "Record layout changed");
+
+// FNV-1a; stable across builds, unlike std::hash.
+inline uint64_t hashName(std::string_view s)
+{
+  uint64_t h = 0xcbf29ce484222325ull;
+  for (unsigned char c : s) {
+    h ^= c;
+    h *= 0x100000001b3ull;
+  }
+  return h;
+}
+
+class Reader {
+public:
+  Reader() = default;
+  Reader(const Reader &) = delete;
+  Reader &operator=(const Reader &) = delete;
+  ~Reader()
+  {
+    if (base)
+      munmap(const_cast<char *>(base), length);
+  }
+
+  bool open(const char *path, std::string &error)
+  {
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0) {
+      error = std::string("cannot open ") + path + ": " + strerror(errno);
+      return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || size_t(st.st_size) < sizeof(Header)) {
+      error = std::string(path) + ": not a decls database";
+      ::close(fd);
+      return false;
+    }
+    length = st.st_size;
+    void *map = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED) {
+      error = std::string("cannot map ") + path + ": " + strerror(errno);
+      return false;
+    }
+    base = static_cast<const char *>(map);
+    hdr = reinterpret_cast<const Header *>(base);
+
+    if (memcmp(hdr->magic, Magic, sizeof(Magic)) != 0 ||
+        hdr->version != Version || hdr->record_size != sizeof(Record) ||
+        !fits(hdr->records_offset, hdr->num_records * sizeof(Record)) ||
+        !fits(hdr->strtab_offset, hdr->strtab_size) ||
+        (hdr->hash_offset &&
+         !fits(hdr->hash_offset, hdr->hash_buckets * sizeof(uint32_t)))) {
+      error = std::string(path) + ": not a decls database";
+      return false;
+    }
+    return true;
+  }
+
+  uint64_t size() const { return hdr->num_records; }
+
+  const Record &record(uint64_t i) const
+  {
+    return reinterpret_cast<const Record *>(base + hdr->records_offset)[i];
+  }
+
+  std::string_view str(uint32_t offset) const
+  {
+    if (offset >= hdr->strtab_size)
+      return {};
+    const char *s = base + hdr->strtab_offset + offset;
+    return std::string_view(s, strnlen(s, hdr->strtab_size - offset));
+  }
+
+  // Calls fn(record) for every record named `name`. Uses the name index
+  // when present, otherwise falls back to a linear scan.
+  template <class Fn>
+  void lookup(std::string_view name, Fn fn) const
+  {
+    if (!hdr->hash_offset || !hdr->hash_buckets) {
+      for (uint64_t i = 0; i < size(); i++)
+        if (str(record(i).name) == name)
+          fn(record(i));
+      return;
+    }
+    const uint32_t *slots =
+        reinterpret_cast<const uint32_t *>(base + hdr->hash_offset);
+    uint64_t mask = hdr->hash_buckets - 1;
+    for (uint64_t b = hashName(name) & mask; slots[b]; b = (b + 1) & mask) {
+      if (slots[b] > size())
+        break;
+      const Record &r = record(slots[b] - 1);
+      if (str(r.name) == name)
+        fn(r);
+    }
+  }
+
+private:
+  bool fits(uint64_t offset, uint64_t bytes) const
+  {
+    return offset <= length && bytes <= length - offset;
+  }
+
+  const char *base = nullptr;
+  size_t length = 0;
+  const Header *hdr = nullptr;
+};
+
+} // namespace declbin
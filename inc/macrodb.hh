@@ -0,0 +1,296 @@
+#pragma once
+//
+// On-disk layout of the macro database written by `macro-obs --db`, a
+// writer that collects definitions and expansions from any number of TUs,
+// and a reader that mmaps the file and answers queries in place.
+//
+// Layout (little-endian, offsets from the start of the file):
+//
+//   Header          fixed 64 bytes, see below
+//   Definition[n]   at defs_offset, sorted by (name, file, line, column)
+//   Expansion[n]    at expansions_offset, sorted the same way
+//   string table    NUL-terminated strings, at strtab_offset; every string
+//                   field of a record is a byte offset into this table
+//
+// Both record arrays are sorted by name first, so all records for one
+// name are contiguous and found by binary search. Duplicates (a header
+// seen by many TUs) are dropped as they are added.
+//
+// The reader assumes a little-endian host, as does everything else here.
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace macrodb {
+
+constexpr char Magic[8] = {'M', 'A', 'C', 'R', 'O', 'D', 'B', '1'};
+constexpr uint32_t Version = 1;
+
+struct Header {
+  char magic[8];
+  uint32_t version;
+  uint32_t reserved;
+  uint64_t num_defs;
+  uint64_t defs_offset;
+  uint64_t num_expansions;
+  uint64_t expansions_offset;
+  uint64_t strtab_offset;
+  uint64_t strtab_size;
+};
+static_assert(sizeof(Header) == 64, "Header layout changed");
+
+struct Definition {
+  uint32_t name;          // string table offsets
+  uint32_t file;          // absolute path; empty for built-in macros
+  uint32_t line;
+  uint32_t column;
+  uint64_t body_hash;     // hashText(body)
+  uint32_t body;          // normalized text, name and parameters included
+  uint8_t function_like;
+  uint8_t reserved[3];
+};
+static_assert(sizeof(Definition) == 32, "Definition layout changed");
+
+struct Expansion {
+  uint32_t name;
+  uint32_t file;
+  uint32_t line;
+  uint32_t column;
+};
+static_assert(sizeof(Expansion) == 16, "Expansion layout changed");
+
+// FNV-1a; stable across builds, unlike std::hash.
+inline uint64_t hashText(std::string_view s)
+{
+  uint64_t h = 0xcbf29ce484222325ull;
+  for (unsigned char c : s) {
+    h ^= c;
+    h *= 0x100000001b3ull;
+  }
+  return h;
+}
+
+// Collects records in memory and writes them sorted. A record that is
+// already there (the same header seen by another TU) is dropped on the way
+// in, so memory grows with the distinct macros rather than with the number
+// of TUs. Not thread-safe; callers adding from several threads lock
+// around it.
+class Writer {
+public:
+  void addDefinition(std::string_view name, std::string_view file, uint32_t line,
+                     uint32_t column, std::string_view body, bool function_like)
+  {
+    Definition d = {};
+    d.name = intern(name);
+    d.file = intern(file);
+    d.line = line;
+    d.column = column;
+    d.body_hash = hashText(body);
+    if (!seen_defs.insert(Site{d.name, d.file, line, column, d.body_hash}).second)
+      return;
+    d.body = intern(body);
+    d.function_like = function_like;
+    defs.push_back(d);
+  }
+
+  void addExpansion(std::string_view name, std::string_view file, uint32_t line,
+                    uint32_t column)
+  {
+    Expansion e = {intern(name), intern(file), line, column};
+    if (seen_expansions.insert(Site{e.name, e.file, line, column, 0}).second)
+      expansions.push_back(e);
+  }
+
+  bool write(const char *path, std::string &error)
+  {
+    auto key = [&](const auto &r) {
+      return std::make_tuple(str(r.name), str(r.file), r.line, r.column);
+    };
+    std::sort(defs.begin(), defs.end(), [&](const Definition &a, const Definition &b) {
+      return std::make_tuple(key(a), a.body_hash) < std::make_tuple(key(b), b.body_hash);
+    });
+    std::sort(expansions.begin(), expansions.end(),
+              [&](const Expansion &a, const Expansion &b) { return key(a) < key(b); });
+
+    Header h = {};
+    memcpy(h.magic, Magic, sizeof(Magic));
+    h.version = Version;
+    h.num_defs = defs.size();
+    h.defs_offset = sizeof(Header);
+    h.num_expansions = expansions.size();
+    h.expansions_offset = h.defs_offset + defs.size() * sizeof(Definition);
+    h.strtab_offset = h.expansions_offset + expansions.size() * sizeof(Expansion);
+    h.strtab_size = strtab.size();
+
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+      error = std::string("cannot open ") + path + ": " + strerror(errno);
+      return false;
+    }
+    fwrite(&h, sizeof(h), 1, f);
+    fwrite(defs.data(), sizeof(Definition), defs.size(), f);
+    fwrite(expansions.data(), sizeof(Expansion), expansions.size(), f);
+    fwrite(strtab.data(), 1, strtab.size(), f);
+    bool failed = ferror(f);
+    if (fclose(f) != 0)
+      failed = true;
+    if (failed) {
+      error = std::string("cannot write ") + path + ": " + strerror(errno);
+      return false;
+    }
+    return true;
+  }
+
+private:
+  // Where a record is, by interned name and file; hash is the body hash
+  // for definitions and 0 for expansions.
+  struct Site {
+    uint32_t name, file, line, column;
+    uint64_t hash;
+
+    bool operator==(const Site &o) const
+    {
+      return name == o.name && file == o.file && line == o.line &&
+             column == o.column && hash == o.hash;
+    }
+  };
+
+  struct SiteHash {
+    size_t operator()(const Site &s) const
+    {
+      uint64_t h = s.hash;
+      for (uint32_t v : {s.name, s.file, s.line, s.column})
+        h = (h ^ v) * 0x100000001b3ull;
+      return h;
+    }
+  };
+
+  uint32_t intern(std::string_view s)
+  {
+    auto it = offsets.find(s);
+    if (it != offsets.end())
+      return it->second;
+    uint32_t offset = strtab.size();
+    strtab.append(s.data(), s.size());
+    strtab += '\0';
+    // Keys view their own copy, which never moves once inserted.
+    strings.emplace_back(s);
+    offsets.emplace(strings.back(), offset);
+    return offset;
+  }
+
+  std::string_view str(uint32_t offset) const { return strtab.c_str() + offset; }
+
+  std::vector<Definition> defs;
+  std::vector<Expansion> expansions;
+  std::unordered_set<Site, SiteHash> seen_defs;
+  std::unordered_set<Site, SiteHash> seen_expansions;
+  std::string strtab;
+  std::deque<std::string> strings;
+  std::unordered_map<std::string_view, uint32_t> offsets;
+};
+
+class Reader {
+public:
+  Reader() = default;
+  Reader(const Reader &) = delete;
+  Reader &operator=(const Reader &) = delete;
+  ~Reader()
+  {
+    if (base)
+      munmap(const_cast<char *>(base), length);
+  }
+
+  bool open(const char *path, std::string &error)
+  {
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0) {
+      error = std::string("cannot open ") + path + ": " + strerror(errno);
+      return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || size_t(st.st_size) < sizeof(Header)) {
+      error = std::string(path) + ": not a macro database";
+      ::close(fd);
+      return false;
+    }
+    length = st.st_size;
+    void *map = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED) {
+      error = std::string("cannot map ") + path + ": " + strerror(errno);
+      return false;
+    }
+    base = static_cast<const char *>(map);
+    hdr = reinterpret_cast<const Header *>(base);
+
+    if (memcmp(hdr->magic, Magic, sizeof(Magic)) != 0 || hdr->version != Version ||
+        !fits(hdr->defs_offset, hdr->num_defs * sizeof(Definition)) ||
+        !fits(hdr->expansions_offset, hdr->num_expansions * sizeof(Expansion)) ||
+        !fits(hdr->strtab_offset, hdr->strtab_size)) {
+      error = std::string(path) + ": not a macro database";
+      return false;
+    }
+    return true;
+  }
+
+  std::string_view str(uint32_t offset) const
+  {
+    if (offset >= hdr->strtab_size)
+      return {};
+    const char *s = base + hdr->strtab_offset + offset;
+    return std::string_view(s, strnlen(s, hdr->strtab_size - offset));
+  }
+
+  // Calls fn(definition) for every definition of `name`, in file order.
+  template <class Fn>
+  void definitions(std::string_view name, Fn fn) const
+  {
+    auto *first = reinterpret_cast<const Definition *>(base + hdr->defs_offset);
+    forName(first, first + hdr->num_defs, name, fn);
+  }
+
+  // Calls fn(expansion) for every expansion site of `name`, in file order.
+  template <class Fn>
+  void expansions(std::string_view name, Fn fn) const
+  {
+    auto *first = reinterpret_cast<const Expansion *>(base + hdr->expansions_offset);
+    forName(first, first + hdr->num_expansions, name, fn);
+  }
+
+private:
+  template <class Record, class Fn>
+  void forName(const Record *first, const Record *last, std::string_view name, Fn fn) const
+  {
+    auto less = [&](const Record &r, std::string_view n) { return str(r.name) < n; };
+    for (auto *r = std::lower_bound(first, last, name, less);
+         r != last && str(r->name) == name; ++r)
+      fn(*r);
+  }
+
+  bool fits(uint64_t offset, uint64_t bytes) const
+  {
+    return offset <= length && bytes <= length - offset;
+  }
+
+  const char *base = nullptr;
+  size_t length = 0;
+  const Header *hdr = nullptr;
+};
+
+} // namespace macrodb
@@ -0,0 +1,127 @@
+#!/bin/bash
+# Time decls in its default and --fast modes, and the libclang backend:
+# wall and user time, peak RSS, and throughput in declarations per second.
+#
+# Usage: [BASELINE=<rev>] scr/bench-decls.sh [tree] [-- clang-args...]
+#
+# Always runs over eg/; with a tree (a directory holding
+# compile_commands.json), runs over every TU in it as well.
+#
+# With BASELINE set to a git revision, also builds tmp/decls-baseline
+# from that revision's bin/decls.cc and times it in its default mode as
+# "before", so that the other lines read as before/after figures.
+#
+# Heap allocations per declaration are counted over eg/ by preloading
+# tmp/count-new.so, which counts every call to operator new, so they cover
+# the whole run and the baseline can be counted the same way. With
+# etc/cxxflags in place it also builds tmp/decls-allocs, a copy of decls
+# compiled with -DDECLS_COUNT_ALLOCS, and prints how many allocations
+# rendering alone took per declaration.
+
+DECLS=${DECLS:-./bin/decls}
+JOBS=${JOBS:-0}
+CXX=${CXX:-clang++}
+
+tree=
+if [ $# -gt 0 ] && [ "$1" != "--" ]; then
+  tree=$1
+  shift
+fi
+[ "$1" == "--" ] && shift
+
+run() {
+  local label=$1 decls=$2
+  shift 2
+  /usr/bin/time -f "%e %U %M" -o tmp/bench-decls.time \
+    "$decls" "$@" >tmp/bench-decls.out 2>tmp/bench-decls.err
+  local total
+  total=$(sed -n 's/.*Total: \([0-9]*\).*/\1/p' tmp/bench-decls.out)
+  awk -v l="$label" -v d="${total:-0}" '{
+    printf "%s: %s s wall, %s s user, %s KB max RSS", l, $1, $2, $3
+    if (d > 0 && $1 > 0) printf ", %d decls, %.0f decls/s", d, d / $1
+    printf "\n"
+  }' tmp/bench-decls.time
+}
+
+# build <output> <source> [cxxflags...]
+build() {
+  local out=$1 src=$2
+  shift 2
+  $CXX "$@" -Iinc -c @etc/cxxflags -o "$out.oo" "$src" &&
+    $CXX @etc/ldflags -o "$out" "$out.oo" @etc/libs
+}
+
+mkdir -p tmp
+
+baseline=
+if [ -n "$BASELINE" ]; then
+  git show "$BASELINE:bin/decls.cc" >tmp/decls-baseline.cc &&
+    build tmp/decls-baseline tmp/decls-baseline.cc &&
+    baseline=tmp/decls-baseline
+  [ -n "$baseline" ] || echo "could not build decls at $BASELINE" >&2
+fi
+
+echo "=== eg/ ==="
+for i in 1 2 3; do
+  [ -n "$baseline" ] && run "before  " "$baseline" -j "$JOBS" eg/*.c -- "$@"
+  run "default " "$DECLS" -j "$JOBS" eg/*.c -- "$@"
+  run "--fast  " "$DECLS" -j "$JOBS" --fast eg/*.c -- "$@"
+  run "libclang" "$DECLS" -j "$JOBS" --backend=libclang eg/*.c -- "$@"
+done
+
+if [ -n "$tree" ]; then
+  echo ""
+  echo "=== $tree ==="
+  files=$(python3 -c 'import json,sys; print("\n".join(sorted({e["file"] for e in json.load(open(sys.argv[1]))})))' \
+    "$tree/compile_commands.json")
+  [ -n "$baseline" ] && run "before  " "$baseline" -j "$JOBS" -p "$tree" $files
+  run "default " "$DECLS" -j "$JOBS" -p "$tree" $files
+  run "--fast  " "$DECLS" -j "$JOBS" --fast -p "$tree" $files
+  run "libclang" "$DECLS" -j "$JOBS" --backend=libclang -p "$tree" $files
+fi
+
+# allocs <label> <decls> args...: operator new calls per declaration written
+allocs() {
+  local label=$1 decls=$2 total count
+  shift 2
+  LD_PRELOAD=$PWD/tmp/count-new.so "$decls" "$@" >tmp/bench-decls.out 2>tmp/bench-decls.err
+  total=$(sed -n 's/.*Total: \([0-9]*\).*/\1/p' tmp/bench-decls.out)
+  count=$(sed -n 's/^operator new calls: //p' tmp/bench-decls.err)
+  [ -n "$total" ] && [ -n "$count" ] &&
+    awk -v l="$label" -v n="$count" -v d="$total" \
+      'BEGIN { printf "%s: %d allocations, %d decls, %.1f per decl\n", l, n, d, n / d }'
+}
+
+echo ""
+echo "=== allocations ==="
+cat >tmp/count-new.cc <<'EOF'
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+static std::atomic<unsigned long> Calls;
+
+void *operator new(std::size_t N) {
+  ++Calls;
+  if (void *P = std::malloc(N ? N : 1))
+    return P;
+  throw std::bad_alloc();
+}
+
+void operator delete(void *P) noexcept { std::free(P); }
+void operator delete(void *P, std::size_t) noexcept { std::free(P); }
+
+static struct Report {
+  ~Report() { std::fprintf(stderr, "operator new calls: %lu\n", Calls.load()); }
+} Reporter;
+EOF
+if $CXX -std=c++17 -O2 -shared -fPIC -o tmp/count-new.so tmp/count-new.cc; then
+  [ -n "$baseline" ] && allocs "before  " "$baseline" -j "$JOBS" eg/*.c -- "$@"
+  allocs "default " "$DECLS" -j "$JOBS" eg/*.c -- "$@"
+fi
+
+if [ -f etc/cxxflags ]; then
+  build tmp/decls-allocs bin/decls.cc -DDECLS_COUNT_ALLOCS &&
+    tmp/decls-allocs eg/*.c -- "$@" 2>&1 >/dev/null | tail -1
+fi
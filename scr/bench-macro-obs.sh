@@ -0,0 +1,61 @@
+#!/bin/bash
+# Time macro-obs over a libc-sized header set in each report format.
+#
+# Usage: scr/bench-macro-obs.sh [-- clang-args...]
+#
+# Builds tmp/libc-headers.c, which includes every C standard and common
+# POSIX header found under /usr/include, and reports for each --format its
+# wall time, throughput in macros per second, peak RSS and report size.
+# Source passthrough goes to /dev/null.
+
+MACRO_OBS=${MACRO_OBS:-./bin/macro-obs}
+[ "$1" == "--" ] && shift
+
+headers="assert.h complex.h ctype.h errno.h fenv.h float.h inttypes.h iso646.h
+limits.h locale.h math.h setjmp.h signal.h stdalign.h stdarg.h stdatomic.h
+stdbool.h stddef.h stdint.h stdio.h stdlib.h stdnoreturn.h string.h tgmath.h
+threads.h time.h uchar.h wchar.h wctype.h aio.h arpa/inet.h dirent.h dlfcn.h
+fcntl.h fnmatch.h glob.h grp.h iconv.h langinfo.h libgen.h monetary.h
+netdb.h net/if.h netinet/in.h netinet/tcp.h nl_types.h poll.h pthread.h
+pwd.h regex.h sched.h search.h semaphore.h spawn.h strings.h sys/ipc.h
+sys/mman.h sys/msg.h sys/resource.h sys/select.h sys/sem.h sys/shm.h
+sys/socket.h sys/stat.h sys/statvfs.h sys/time.h sys/times.h sys/types.h
+sys/uio.h sys/un.h sys/utsname.h sys/wait.h syslog.h termios.h unistd.h
+utime.h wordexp.h"
+
+mkdir -p tmp
+src=tmp/libc-headers.c
+: >"$src"
+n=0
+for h in $headers; do
+  if [ -f "/usr/include/$h" ] || [ -f "/usr/include/x86_64-linux-gnu/$h" ]; then
+    echo "#include <$h>" >>"$src"
+    n=$((n + 1))
+  fi
+done
+echo "$n headers in $src"
+
+# The macro count comes from a jsonl run up front, which also warms the
+# page cache for the timed runs.
+"$MACRO_OBS" "$src" --format=jsonl -o tmp/bench-macro-obs.jsonl -- "$@" >/dev/null
+macros=$(sed -n 's/.*"event":"total","macros":\([0-9]*\).*/\1/p' tmp/bench-macro-obs.jsonl)
+echo "${macros:-?} macros"
+
+run() {
+  local label=$1 out=$2
+  shift 2
+  /usr/bin/time -f "%e %U %M" -o tmp/bench-macro-obs.time \
+    "$MACRO_OBS" "$src" "$@" >/dev/null 2>tmp/bench-macro-obs.err
+  awk -v l="$label" -v m="${macros:-0}" '{
+    printf "%s: %s s wall, %s s user, %s KB max RSS", l, $1, $2, $3
+    if (m > 0 && $1 > 0) printf ", %.0f macros/s", m / $1
+    printf "\n"
+  }' tmp/bench-macro-obs.time
+  [ -f "$out" ] && echo "  $(wc -c <"$out") bytes of report"
+}
+
+for i in 1 2 3; do
+  run "text " tmp/bench-macro-obs.txt -o tmp/bench-macro-obs.txt -- "$@"
+  run "jsonl" tmp/bench-macro-obs.jsonl --format=jsonl -o tmp/bench-macro-obs.jsonl -- "$@"
+  run "bin  " tmp/bench-macro-obs.bin --format=bin -o tmp/bench-macro-obs.bin -- "$@"
+done
@@ -0,0 +1,123 @@
+#!/bin/bash
+# Regression checks for decls. Each check builds its inputs under
+# tmp/test-decls and runs decls on them.
+#
+# Usage: scr/test-decls.sh [check...]
+#
+# With no arguments every check runs. Exits non-zero if any fails.
+
+DECLS=${DECLS:-./bin/decls}
+T=tmp/test-decls
+failed=0
+
+fail() {
+  echo "FAIL $check: $*"
+  failed=1
+}
+
+# A TU that does not compile must not be indexed: the next run has to
+# parse it again and report its errors again, rather than serve the
+# declarations it got through and exit 0.
+check_index_skips_failed_tu() {
+  rm -rf "$T/index" && mkdir -p "$T/index"
+  printf 'int good(void);\n' >"$T/index/good.c"
+  printf 'int broken(void) { return undeclared; }\n' >"$T/index/broken.c"
+  local run
+  for run in 1 2; do
+    "$DECLS" --index-dir="$T/index/idx" --profile="$T/index/profile.$run.json" \
+      "$T/index/good.c" "$T/index/broken.c" -- >/dev/null 2>"$T/index/err.$run" &&
+      fail "run $run exited 0"
+    grep -q undeclared "$T/index/err.$run" || fail "run $run did not report the error"
+  done
+  [ "$(grep -c '"cached": true' "$T/index/profile.2.json")" == 1 ] ||
+    fail "run 2 should serve good.c from the index and re-parse broken.c"
+}
+
+# Header ownership must not depend on which worker gets to a header
+# first, and the Total footer must count what was actually written.
+check_headers_deterministic() {
+  rm -rf "$T/headers" && mkdir -p "$T/headers"
+  printf 'struct shared { int x; };\nint shared_fn(void);\n' >"$T/headers/shared.h"
+  local i
+  for i in 1 2 3 4 5 6 7 8; do
+    printf '#include "shared.h"\nint tu%d(struct shared *s);\n' $i >"$T/headers/tu$i.c"
+  done
+  local j
+  for j in 1 4; do
+    "$DECLS" -j $j --include-headers "$T"/headers/tu*.c -- >"$T/headers/out.$j" ||
+      fail "-j $j exited non-zero"
+  done
+  cmp -s "$T/headers/out.1" "$T/headers/out.4" || fail "-j 1 and -j 4 differ"
+  [ "$(grep -c 'shared_fn' "$T/headers/out.1")" == 1 ] ||
+    fail "shared.h should be emitted once"
+  local total
+  total=$(sed -n 's/.*Total: \([0-9]*\).*/\1/p' "$T/headers/out.1")
+  [ -n "$total" ] && [ "$total" == "$(grep -Ec '// (definition|declaration) at ' "$T/headers/out.1")" ] ||
+    fail "Total footer does not match the declarations written"
+}
+
+# --kinds=Function must still find functions declared at block scope in C.
+check_kinds_block_scope_function() {
+  rm -rf "$T/kinds" && mkdir -p "$T/kinds"
+  printf 'struct s { int field; };
+void f(void) { extern int g(void); g(); }
+' \
+    >"$T/kinds/block.c"
+  "$DECLS" --kinds=Function "$T/kinds/block.c" -- >"$T/kinds/out" ||
+    fail "exited non-zero"
+  grep -q 'int g(void)' "$T/kinds/out" || fail "block-scope g was not reported"
+  grep -q 'field' "$T/kinds/out" && fail "struct fields should be filtered out"
+}
+
+# With -p and no file arguments, every TU in the database is processed;
+# a -p without a database is an error, not a crash.
+check_database_without_files() {
+  rm -rf "$T/db" && mkdir -p "$T/db/build"
+  printf 'int from_db(void);\n' >"$T/db/a.c"
+  local dir
+  dir=$(cd "$T/db" && pwd)
+  printf '[{"directory": "%s", "file": "a.c", "command": "cc -c a.c"}]\n' "$dir" \
+    >"$T/db/build/compile_commands.json"
+  "$DECLS" -p "$T/db/build" >"$T/db/out" 2>"$T/db/err" || fail "-p exited non-zero"
+  grep -q from_db "$T/db/out" || fail "-p did not process the database's TUs"
+  # Outside the repo, so no compile_commands.json above it is picked up.
+  local empty
+  empty=$(mktemp -d)
+  "$DECLS" -p "$empty" >/dev/null 2>"$T/db/err" && fail "-p without a database exited 0"
+  grep -q 'no compilation database' "$T/db/err" || fail "-p without a database gave no diagnostic"
+  rmdir "$empty"
+}
+
+# A declaration made by a macro belongs to the file the macro is used in,
+# token-pasted names included, and is printed under that file.
+check_headers_macro_declarations() {
+  rm -rf "$T/macro" && mkdir -p "$T/macro"
+  printf '#define DECLARE(n) int n##_fn(void);\n' >"$T/macro/defs.h"
+  printf '#include "defs.h"\nDECLARE(pasted)\n' >"$T/macro/use.h"
+  printf '#include "use.h"\nint main_fn(void);\n' >"$T/macro/a.c"
+  printf '#include "use.h"\nint other_fn(void);\n' >"$T/macro/b.c"
+  "$DECLS" --include-headers "$T/macro/a.c" "$T/macro/b.c" -- >"$T/macro/out" ||
+    fail "exited non-zero"
+  [ "$(grep -c 'pasted_fn.*use\.h:2:' "$T/macro/out")" == 1 ] ||
+    fail "pasted_fn should be reported once, at its use in use.h"
+  grep -q ' at :' "$T/macro/out" && fail "a declaration was printed without a file"
+}
+
+# --serve must not delete a file that is not a socket.
+check_serve_keeps_other_files() {
+  rm -rf "$T/serve" && mkdir -p "$T/serve"
+  printf '[]\n' >"$T/serve/compile_commands.json"
+  printf 'keep me\n' >"$T/serve/file"
+  "$DECLS" -p "$T/serve" --serve="$T/serve/file" 2>"$T/serve/err" &&
+    fail "exited 0"
+  grep -q 'not a socket' "$T/serve/err" || fail "no diagnostic"
+  grep -q 'keep me' "$T/serve/file" || fail "the file was deleted"
+}
+
+mkdir -p "$T"
+checks=${*:-$(declare -F | awk '$3 ~ /^check_/ { sub(/^check_/, "", $3); print $3 }')}
+for check in $checks; do
+  "check_$check"
+done
+[ $failed == 0 ] && echo "all decls checks passed"
+exit $failed